@@ -12,9 +12,32 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <fstream>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <sys/resource.h>
+#include <climits>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <termios.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <new>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 using namespace std;
 
+extern char **environ;
+
 const std::string WHITESPACE = " \n\r\t\f\v";
 
 #if 0
@@ -56,37 +79,270 @@ string _trim(const std::string& s)
 }
 
 bool IsStringNumber(const string &str) {
-    string::const_iterator it = str.begin();
-    if(*it == '-'){
-        ++it;
+    size_t digits = (!str.empty() && str[0] == '-') ? 1 : 0;
+    if (digits == str.size()) { // "" and a lone "-"
+        return false;
     }
-    while (it != str.end() && isdigit(*it)) {
-        ++it;
+    for (size_t i = digits; i < str.size(); i++) {
+        if (!isdigit((unsigned char) str[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// a byte count with an optional K, M, G or T suffix, for limit --mem and pipesize
+bool ParseSize(const string &str, long long *bytes) {
+    if (str.empty() || str.size() > 15) {
+        return false;
+    }
+    string digits = str;
+    long long unit = 1;
+    switch (toupper(str.back())) {
+        case 'K': unit = 1LL << 10; break;
+        case 'M': unit = 1LL << 20; break;
+        case 'G': unit = 1LL << 30; break;
+        case 'T': unit = 1LL << 40; break;
+        default: break;
+    }
+    if (unit != 1) {
+        digits.pop_back();
+    }
+    if (digits.empty() || digits[0] == '-' || !IsStringNumber(digits)) {
+        return false;
+    }
+    long long number = stoll(digits);
+    if (number <= 0 || number > LLONG_MAX / unit) { // 15 digits of T would overflow the multiplication
+        return false;
+    }
+    *bytes = number * unit;
+    return true;
+}
+
+// the offset right after the count-th word of line, npos when it has fewer words
+size_t SkipWords(const string &line, int count) {
+    size_t pos = 0;
+    for (int i = 0; i < count; i++) {
+        pos = line.find_first_not_of(WHITESPACE, pos);
+        if (pos == FIND_FAIL) {
+            return FIND_FAIL;
+        }
+        pos = line.find_first_of(WHITESPACE, pos);
+        if (pos == FIND_FAIL) {
+            pos = line.size();
+        }
+    }
+    return pos;
+}
+
+int StatusFromWait(int wait_status) {
+    if (WIFEXITED(wait_status)) {
+        return WEXITSTATUS(wait_status);
+    }
+    if (WIFSIGNALED(wait_status)) {
+        return 128 + WTERMSIG(wait_status);
+    }
+    return 0;
+}
+
+void IgnoreSigpipe(struct sigaction *old_action) {
+    struct sigaction ignore;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigemptyset(&ignore.sa_mask);
+    sigaction(SIGPIPE, &ignore, old_action);
+}
+
+void RestoreSigpipe(const struct sigaction *old_action) {
+    sigaction(SIGPIPE, old_action, NULL);
+}
+
+// the index of the ) closing the $( at pos, npos when it is never closed
+static size_t FindSubstitutionEnd(const string &line, size_t pos) {
+    int depth = 1;
+    char quote = 0;
+    for (size_t i = pos + 2; i < line.size(); i++) {
+        if (line[i] == '\\' && quote != '\'') {
+            i++;
+        }
+        else if ((line[i] == '\'' || line[i] == '"') && (quote == 0 || quote == line[i])) {
+            quote = (quote == 0) ? line[i] : 0;
+        }
+        else if (quote == 0 && line[i] == '(') {
+            depth++;
+        }
+        else if (quote == 0 && line[i] == ')' && --depth == 0) {
+            return i;
+        }
+    }
+    return FIND_FAIL;
+}
+
+// like find_first_of, but skips quotes, backslash escapes, $(...) and ${...}
+size_t FindUnquoted(const string &line, const string &chars, size_t pos) {
+    char quote = 0;
+    for (size_t i = pos; i < line.size(); i++) {
+        char c = line[i];
+        if (c == '\\' && quote != '\'') {
+            i++;
+        }
+        else if ((c == '\'' || c == '"') && (quote == 0 || quote == c)) {
+            quote = (quote == 0) ? c : 0;
+        }
+        else if (c == '$' && quote != '\'' && i + 1 < line.size() && (line[i + 1] == '(' || line[i + 1] == '{')) {
+            size_t end = (line[i + 1] == '(') ? FindSubstitutionEnd(line, i) : line.find('}', i);
+            if (end == FIND_FAIL) {
+                return FIND_FAIL;
+            }
+            i = end;
+        }
+        else if (quote == 0 && chars.find(c) != FIND_FAIL) {
+            return i;
+        }
+    }
+    return FIND_FAIL;
+}
+
+// appends text to the last part of word when that is literal text quoted the same way
+static void AddLiteral(LexedWord &word, const string &text, bool quoted) {
+    if (!word.empty() && word.back().kind == WordPart::Literal && word.back().quoted == quoted) {
+        word.back().text += text;
+        return;
+    }
+    WordPart part = {WordPart::Literal, text, quoted};
+    word.push_back(part);
+}
+
+static void AddPart(LexedWord &word, WordPart::Kind kind, const string &text, bool quoted) {
+    WordPart part = {kind, text, quoted};
+    word.push_back(part);
+}
+
+// a ~ only expands while the word has nothing but unquoted expansions, they may turn out empty
+static bool MayExpandHome(const LexedWord &word) {
+    for (size_t i = 0; i < word.size(); i++) {
+        if (word[i].quoted || (word[i].kind != WordPart::Variable && word[i].kind != WordPart::Substitution)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// splits line into words and removes quotes, variables, $(...) and ~ are kept as parts for ExpandLexed
+bool LexWords(const string &line, vector<LexedWord> &words, string *error) {
+    LexedWord word;
+    string name;
+    char quote = 0;
+    for (size_t i = 0; i < line.size(); i++) {
+        char c = line[i];
+        if (quote == '\'') {
+            if (c == '\'') {
+                quote = 0;
+            }
+            else {
+                AddLiteral(word, string(1, c), true);
+            }
+        }
+        else if (c == '\\' && i + 1 < line.size() && (quote == 0 || strchr("$\"\\`", line[i + 1]) != nullptr)) {
+            AddLiteral(word, string(1, line[++i]), true);
+        }
+        else if (c == '"' && quote == '"') {
+            quote = 0;
+        }
+        else if (quote == 0 && (c == '\'' || c == '"')) {
+            quote = c;
+            AddLiteral(word, "", true); // "" is still a word
+        }
+        else if (c == '$' && i + 1 < line.size() && line[i + 1] == '(') {
+            size_t end = FindSubstitutionEnd(line, i);
+            if (end == FIND_FAIL) {
+                *error = "unterminated $(";
+                return false;
+            }
+            AddPart(word, WordPart::Substitution, line.substr(i + 2, end - i - 2), quote == '"');
+            i = end;
+        }
+        else if (c == '$' && Environment::ParseVariable(line, i, &name)) {
+            AddPart(word, WordPart::Variable, name, quote == '"');
+        }
+        else if (quote == 0 && isspace((unsigned char) c)) {
+            if (!word.empty()) {
+                words.push_back(word);
+                word.clear();
+            }
+        }
+        else if (quote == 0 && c == '~' && MayExpandHome(word) && (i + 1 == line.size() || line[i + 1] == '/' ||
+                                                                  isspace((unsigned char) line[i + 1]))) {
+            AddPart(word, WordPart::Home, "", false);
+        }
+        else {
+            AddLiteral(word, string(1, c), quote != 0);
+        }
     }
-    return !str.empty() && it == str.end();
+    if (quote != 0) {
+        *error = "unterminated quote";
+        return false;
+    }
+    if (!word.empty()) {
+        words.push_back(word);
+    }
+    return true;
 }
 
 bool IsRedirectionCommand(const char *cmd_line) {
-    string str = cmd_line;
-    return str.find(">") != FIND_FAIL;
+    return FindUnquoted(cmd_line, ">") != FIND_FAIL;
 }
 
 void RemoveRedirectionSign(char *cmd_line) {
-    const string str(cmd_line);
-    size_t pos = str.find(">");
+    size_t pos = FindUnquoted(cmd_line, ">");
     if (pos != FIND_FAIL) {
         cmd_line[pos] = 0;
     }
 }
 
+bool IsInputRedirectionCommand(const char *cmd_line) {
+    return FindUnquoted(cmd_line, "<") != FIND_FAIL;
+}
+
+long long MonotonicNanos() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NANOS_PER_SECOND + now.tv_nsec;
+}
+
+// seconds with millisecond precision, for jobs
+static string FormatSeconds(long long nanos) {
+    ostringstream seconds;
+    seconds << fixed << setprecision(3) << nanos / (double) NANOS_PER_SECOND;
+    return seconds.str();
+}
+
+string JsonString(const string &str) {
+    string json = "\"";
+    for (size_t i = 0; i < str.size(); i++) {
+        unsigned char c = str[i];
+        if (c == '"' || c == '\\') {
+            json += '\\';
+            json += (char) c;
+        }
+        else if (c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            json += escaped;
+        }
+        else {
+            json += (char) c;
+        }
+    }
+    return json + "\"";
+}
+
 bool IsPipeCommand(const char *cmd_line) {
-    string cmd_str = cmd_line;
-    return cmd_str.find("|") != FIND_FAIL;
+    return FindUnquoted(cmd_line, "|") != FIND_FAIL;
 }
 
 void RemovePipeSign(char *cmd_line) {
-    const string str(cmd_line);
-    size_t pos = str.find("|");
+    size_t pos = FindUnquoted(cmd_line, "|");
     if (pos != FIND_FAIL) {
         cmd_line[pos] = 0;
     }
@@ -95,7 +351,7 @@ void RemovePipeSign(char *cmd_line) {
 int ParseCommandLine(string cmd_line, vector<string> &args) {
   FUNC_ENTRY()
   int i = 0;
-  std::istringstream iss(_trim(string(cmd_line)).c_str());
+  std::istringstream iss(_trim(cmd_line)); // not c_str(), a NUL byte must not end the line
   for(std::string s; iss >> s;) {
        args.push_back(s);
         ++i;
@@ -107,9 +363,33 @@ int ParseCommandLine(string cmd_line, vector<string> &args) {
 
 bool IsBuiltInCommand(string cmd_line) {
     vector<string> args = vector<string>();
-    ParseCommandLine(cmd_line.c_str(), args);
-    vector<string> built_in_commands = {"chprompt", "showpid", "pwd", "cd", "jobs", "kill", "fg", "bg", "quit"};
-    return find(built_in_commands.begin(), built_in_commands.end(), args.at(0)) != built_in_commands.end();
+    if (ParseCommandLine(cmd_line.c_str(), args) == 0) {
+        return false;
+    }
+    static constexpr const char* built_in_commands[] = {"chprompt", "showpid", "pwd", "cd", "jobs", "kill", "fg", "bg",
+                                                        "quit", "cpupolicy", "send", "recv", "pipesize", "wait",
+                                                        "export", "unset"};
+    return find(begin(built_in_commands), end(built_in_commands), args.at(0)) != end(built_in_commands);
+}
+
+// every command CreateCommand makes itself instead of an ExternalCommand
+static constexpr const char* smash_commands[] = {"chprompt", "showpid", "pwd", "cd", "jobs", "kill", "fg", "bg",
+                                                 "quit", "ls", "cp", "cpupolicy", "coproc", "send", "recv",
+                                                 "pipesize", "passthru", "timeout", "cpuset", "numa", "limit",
+                                                 "export", "unset", "wait"};
+
+static bool IsSmashCommand(const string &name) {
+    return find(begin(smash_commands), end(smash_commands), name) != end(smash_commands);
+}
+
+bool IsInProcessBuiltIn(string cmd_line) {
+    vector<string> args = vector<string>();
+    if (ParseCommandLine(cmd_line.c_str(), args) == 0) {
+        return false;
+    }
+    // only builtins without side effects on smash may run outside of a forked pipe stage
+    static constexpr const char* producers[] = {"showpid", "pwd", "jobs", "ls"};
+    return find(begin(producers), end(producers), args.at(0)) != end(producers);
 }
 
 bool IsTimeoutCommand(const char *cmd_line) {
@@ -118,67 +398,73 @@ bool IsTimeoutCommand(const char *cmd_line) {
     return args.size() > 0 && args[0] == "timeout";
 }
 
+// drops "timeout N", the rest only gets shorter so it is moved within the same buffer
 void RemoveTimeoutSign(char *cmd_line) {
-    vector<string> args = vector<string>();
-    ParseCommandLine(cmd_line, args);
-    const string str = cmd_line;
-    size_t pos = str.find(args[1]) + args[1].size();
-    strcpy(cmd_line, str.substr(pos).c_str());
+    size_t pos = SkipWords(cmd_line, 2);
+    size_t length = strlen(cmd_line);
+    pos = (pos == FIND_FAIL) ? length : pos;
+    memmove(cmd_line, cmd_line + pos, length - pos + 1);
 }
 
 bool IsBackgroundCommand(string cmd_line) {
-  const string str(cmd_line);
-  return str[str.find_last_not_of(WHITESPACE)] == '&';
+  size_t idx = cmd_line.find_last_not_of(WHITESPACE);
+  return idx != string::npos && cmd_line[idx] == '&';
 }
 
 
-void RemoveBackgroundSign(char* cmd_line) {
-  const string str(cmd_line);
-  unsigned int idx = str.find_last_not_of(WHITESPACE);
-  if (idx == string::npos) {
-    return;
-  }
-  if (cmd_line[idx] != '&') {
-    return;
-  }
-  cmd_line[idx] = ' ';
-  cmd_line[str.find_last_not_of(WHITESPACE, idx) + 1] = 0;
+// strips every trailing & with the whitespace around it, so removing twice changes nothing
+string RemoveBackgroundSign(string str){
+    size_t end = str.find_last_not_of(WHITESPACE);
+    bool stripped = false;
+    while (end != string::npos && str[end] == '&') {
+        stripped = true;
+        end = (end == 0) ? string::npos : str.find_last_not_of(WHITESPACE, end - 1);
+    }
+    if (stripped) {
+        str.erase((end == string::npos) ? 0 : end + 1);
+    }
+    return str;
 }
 
-string RemoveBackgroundSign(string str){
-    char *cstr = new char[str.length() + 1];
-    strcpy(cstr, str.c_str());
-    RemoveBackgroundSign(cstr);
-    return cstr;
+void RemoveBackgroundSign(char* cmd_line) {
+    cmd_line[RemoveBackgroundSign(string(cmd_line)).size()] = 0;
 }
 
 string GetFirstStringInCmdLine(const char *cmd_line) {
-    char* new_cmd = new char[strlen(cmd_line) + 1];
-    strcpy(new_cmd, cmd_line);
-    if(IsBackgroundCommand(new_cmd)) {
-        RemoveBackgroundSign(new_cmd);
-    }
     vector<string> args;
-    if(ParseCommandLine(new_cmd, args) == 0){
-        delete new_cmd;
+    if(ParseCommandLine(RemoveBackgroundSign(string(cmd_line)), args) == 0){
         return "";
     }
-    delete new_cmd;
     return (args.at(0));
 }
 
 
-SmallShell &global_smash = SmallShell::GetInstance();
+// the shell is created on first use instead of during static initialization
+static inline SmallShell &GlobalSmash() {
+    return SmallShell::GetInstance();
+}
 
 JobsList::JobEntry::JobEntry(int id, JobState job_state, Command *cmd, pid_t pid, bool is_timeout) : job_id(id),
-job_state(job_state), cmd(cmd), pid(pid), time_out(is_timeout) {
-    time(&add_time);
-    time(&time_stamp);
+job_state(job_state), cmd(cmd), pid(pid), time_out(is_timeout), exit_status(FAIL), timeout_released(false) {
+    start_ns = MonotonicNanos();
+    stopped_ns = 0;
+    stopped_since = (job_state == Stopped) ? start_ns : 0;
     if(time_out) {
         duration = stoi(cmd->GetArgs()->at(1));
     }
 }
 
+JobsList::JobEntry::~JobEntry() {
+    ReleaseTimeout();
+}
+
+void JobsList::JobEntry::ReleaseTimeout() {
+    if(time_out && !timeout_released) {
+        GlobalSmash().GetJobStateTable()->Release(pid);
+        timeout_released = true;
+    }
+}
+
 
 bool JobsCmpSmallerId(const JobsList::JobEntry *job_1, const JobsList::JobEntry *job_2) {
     return (job_1->GetJobId() < job_2->GetJobId());
@@ -188,10 +474,6 @@ bool JobsCmpBiggerId(const JobsList::JobEntry *job_1, const JobsList::JobEntry *
     return (job_1->GetJobId() > job_2->GetJobId());
 }
 
-bool JobsCmpClosestTime(const JobsList::JobEntry *job_1, const JobsList::JobEntry *job_2) {
-    return (job_1->GetDifferentTime() < job_2->GetDifferentTime());
-}
-
 JobsList::JobsList() {
     jobs_list = list<JobEntry *>();
 }
@@ -208,10 +490,13 @@ int JobsList::GetSize() {
     return jobs_list.size();
 }
 
-void JobsList::AddJob(Command *cmd, pid_t pid, JobState state, bool is_timeout) {
+JobsList::JobEntry *JobsList::AddJob(Command *cmd, pid_t pid, JobState state, bool is_timeout) {
     RemoveFinishedJobs();
     JobEntry *new_job = new JobEntry(GetMaxJobId() + 1, state, cmd, pid, is_timeout);
+    ForgetFinishedJob(new_job->GetJobId());
     this->jobs_list.push_back(new_job);
+    EmitEvent("started", new_job);
+    return new_job;
 }
 
 void JobsList::AddJob(JobEntry *job, JobState state, bool to_give_id) {
@@ -220,20 +505,34 @@ void JobsList::AddJob(JobEntry *job, JobState state, bool to_give_id) {
     job->ResetTimeAdded();
     if (to_give_id) {
         job->SetJobId(GetMaxJobId() + 1);
+        ForgetFinishedJob(job->GetJobId());
     }
     this->jobs_list.push_back(job);
 }
 
 void JobsList::RemoveFinishedJobs() {
-    if(!global_smash.IsSmashPid(getpid())) {
+    if(!GlobalSmash().IsSmashPid(getpid())) {
         return;
     }
-    for (list<JobEntry *>::iterator it = jobs_list.begin(); it != jobs_list.end(); ++it) {
-        pid_t pid = waitpid((*it)->GetJobPid(), NULL, WNOHANG);
-        if (pid > 0) {
-            JobsList::JobEntry *job = *it;
-            it = jobs_list.erase(it);
-            delete job;
+    for (list<JobEntry *>::iterator it = jobs_list.begin(); it != jobs_list.end();) {
+        int status = 0;
+        struct rusage usage;
+        pid_t job_pid = (*it)->GetJobPid();
+        JobEntry *job = *it;
+        pid_t pid = wait4(job_pid, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage);
+        ++it;
+        // stops and continues from outside smash (kill -STOP, a debugger) update the job too,
+        // those that fg, bg and ctrl-Z already recorded are not reported twice
+        if (pid > 0 && WIFSTOPPED(status) && job->GetState() != Stopped) {
+            job->SetState(Stopped);
+            EmitEvent("stopped", job);
+        }
+        else if (pid > 0 && WIFCONTINUED(status) && job->GetState() == Stopped) {
+            job->SetState(Background);
+            EmitEvent("continued", job);
+        }
+        else if (pid > 0 && !WIFSTOPPED(status) && !WIFCONTINUED(status)) {
+            MarkFinished(job_pid, status, &usage);
         }
         if (pid < 0) {
             perror("smash error: waitpid failed");
@@ -241,6 +540,48 @@ void JobsList::RemoveFinishedJobs() {
     }
 }
 
+void JobsList::MarkFinished(pid_t pid, int wait_status, const struct rusage *usage) {
+    JobEntry *job = RemoveJobByPid(pid);
+    if (job == nullptr) {
+        return;
+    }
+    job->GetCommand()->GetLimits()->Release();
+    job->ReleaseTimeout(); // the pid may be reused from now on
+    job->SetExitStatus(StatusFromWait(wait_status));
+    bool timed_out = job->IsTimeOut() && WIFSIGNALED(wait_status) && WTERMSIG(wait_status) == SIGKILL;
+    EmitEvent(timed_out ? "timed-out" : "exited", job, job->GetExitStatus(), usage);
+    finished_jobs.push_back(job);
+    if (finished_jobs.size() > JOBS_RETAINED_STATUSES) {
+        delete finished_jobs.front();
+        finished_jobs.pop_front();
+    }
+}
+
+void JobsList::ForgetFinishedJob(int job_id) {
+    delete TakeFinishedJob(job_id);
+}
+
+JobsList::JobEntry *JobsList::TakeFinishedJob(int job_id) {
+    for (list<JobEntry *>::iterator it = finished_jobs.begin(); it != finished_jobs.end(); ++it) {
+        if ((*it)->GetJobId() == job_id) {
+            JobEntry *job = *it;
+            finished_jobs.erase(it);
+            return job;
+        }
+    }
+    return nullptr;
+}
+
+vector<int> JobsList::GetRunningJobIds() {
+    vector<int> job_ids;
+    for (list<JobEntry *>::iterator it = jobs_list.begin(); it != jobs_list.end(); ++it) {
+        if ((*it)->GetState() != Stopped) {
+            job_ids.push_back((*it)->GetJobId());
+        }
+    }
+    return job_ids;
+}
+
 void JobsList::KillAllJobs() {
     for (list<JobEntry *>::iterator it = jobs_list.begin(); it != jobs_list.end(); ++it) {
 
@@ -269,18 +610,92 @@ JobsList::JobEntry *JobsList::RemoveJobByPid(pid_t pid) {
     return nullptr;
 }
 
-void JobsList::PrintJobsList() {
+void JobsList::PrintJobsList(bool verbose, ostream &out) {
     RemoveFinishedJobs();
     jobs_list.sort(JobsCmpSmallerId);
+    long long now = MonotonicNanos();
     for (list<JobEntry *>::iterator it = jobs_list.begin(); it != jobs_list.end(); ++it) {
-        cout << "[" << (*it)->GetJobId() << "] " << (*it)->GetCommand()->GetCmdLine()
-             << " : " << (*it)->GetJobPid() << " " << difftime(time(NULL), (*it)->GetTimeThatAdded()) << " secs";
+        out << "[" << (*it)->GetJobId() << "] " << (*it)->GetCommand()->GetCmdLine()
+             << " : " << (*it)->GetJobPid() << " " << FormatSeconds((*it)->GetElapsedNanos(now)) << " secs";
+        if ((*it)->GetCommand()->Progress() != FAIL) {
+            out << " " << (*it)->GetCommand()->Progress() << "%";
+        }
         if ((*it)->GetState() == Stopped) {
-            cout << " (stopped)" << endl;
+            out << " (stopped)" << endl;
         } else {
-            cout << endl;
+            out << endl;
+        }
+        if (verbose) {
+            out << "    placement: " << (*it)->GetCommand()->GetPlacement()->Describe() << endl;
+            out << "    limits: " << (*it)->GetCommand()->GetLimits()->Describe() << endl;
+            string usage = (*it)->GetCommand()->GetLimits()->Usage();
+            if (!usage.empty()) {
+                out << "    usage: " << usage << endl;
+            }
+        }
+    }
+}
+
+// one "id<TAB>pid<TAB>state<TAB>seconds<TAB>command" line per job, for programs
+void JobsList::PrintJobRecords(ostream &out) {
+    RemoveFinishedJobs();
+    jobs_list.sort(JobsCmpSmallerId);
+    long long now = MonotonicNanos();
+    for (list<JobEntry *>::iterator it = jobs_list.begin(); it != jobs_list.end(); ++it) {
+        out << (*it)->GetJobId() << '\t' << (*it)->GetJobPid() << '\t'
+            << ((*it)->GetState() == Stopped ? "stopped" : "running") << '\t'
+            << FormatSeconds((*it)->GetElapsedNanos(now)) << '\t' << (*it)->GetCommand()->GetCmdLine() << '\n';
+    }
+}
+
+static string JobJson(JobsList::JobEntry *job) {
+    ostringstream json;
+    json << "{\"id\":";
+    if (job->GetJobId() == FAIL) { // a foreground job that never got a job id
+        json << "null";
+    }
+    else {
+        json << job->GetJobId();
+    }
+    json << ",\"pid\":" << job->GetJobPid() << ",\"command\":" << JsonString(job->GetCommand()->GetCmdLine());
+    return json.str();
+}
+
+void JobsList::PrintJobsJson(ostream &out) {
+    RemoveFinishedJobs();
+    jobs_list.sort(JobsCmpSmallerId);
+    out << "[";
+    long long now = MonotonicNanos();
+    for (list<JobEntry *>::iterator it = jobs_list.begin(); it != jobs_list.end(); ++it) {
+        out << (it == jobs_list.begin() ? "" : ",") << JobJson(*it) << ",\"state\":\""
+            << ((*it)->GetState() == Stopped ? "stopped" : "running") << "\",\"seconds\":"
+            << FormatSeconds((*it)->GetElapsedNanos(now)) << ",\"timeout\":"
+            << ((*it)->IsTimeOut() ? "true" : "false");
+        if ((*it)->GetCommand()->Progress() != FAIL) {
+            out << ",\"progress\":" << (*it)->GetCommand()->Progress();
         }
+        out << "}";
     }
+    out << "]" << endl;
+}
+
+// one JSON line per job state change, for jobs --follow and remote followers
+void JobsList::EmitEvent(const char *event, JobEntry *job, int status, const struct rusage *usage) {
+    if (!GlobalSmash().HasJobEventSubscribers()) {
+        return;
+    }
+    ostringstream line;
+    line << "{\"event\":\"" << event << "\",\"time\":" << time(NULL) << "," << JobJson(job).substr(1);
+    if (status != FAIL) {
+        line << ",\"status\":" << status;
+    }
+    if (usage != nullptr) {
+        line << ",\"user_ms\":" << usage->ru_utime.tv_sec * 1000 + usage->ru_utime.tv_usec / 1000
+             << ",\"sys_ms\":" << usage->ru_stime.tv_sec * 1000 + usage->ru_stime.tv_usec / 1000
+             << ",\"max_rss_kb\":" << usage->ru_maxrss;
+    }
+    line << "}\n";
+    GlobalSmash().PublishJobEvent(line.str());
 }
 
 JobsList::JobEntry *JobsList::GetJobById(int job_id) {
@@ -318,33 +733,6 @@ int JobsList::GetMaxStoppedJobId() {
     return 0;
 }
 
-JobsList::JobEntry *JobsList::GetTimeoutJobToKill() {
-    if (jobs_list.empty()) {
-        return nullptr;
-    }
-    else {
-        for (list<JobEntry *>::iterator it = jobs_list.begin(); it != jobs_list.end(); ++it) {
-            if((*it)->IsTimeOut() == true && (*it)->GetDifferentTime() == 0){
-                return *it;
-            }
-        }
-    }
-    return nullptr;
-}
-
-int JobsList::GetClosestTimeout() {
-    if (jobs_list.empty()) {
-        return FAIL;
-    }
-    jobs_list.sort(JobsCmpClosestTime);
-    for (list<JobEntry *>::iterator it = jobs_list.begin(); it != jobs_list.end(); ++it) {
-        if ((*it)->IsTimeOut()) {
-            return (*it)->GetDifferentTime();
-        }
-    }
-    return FAIL;
-}
-
 pid_t JobsList::GetJobPidByJobId(int job_id) {
     list<JobEntry *>::iterator it;
     for (it = jobs_list.begin(); it != jobs_list.end(); ++it) {
@@ -377,362 +765,3835 @@ bool JobsList::IsEmpty() {
 }
 
 
-// TODO: Add your implementation for classes in Commands.h
+JobPlacement::JobPlacement() : has_cpus(false), numa_node(-1) {
+    CPU_ZERO(&cpus);
+}
 
-SmallShell::SmallShell() : prompt("smash"), last_dir(nullptr), fore_ground_job(nullptr) ,smash_pid(getpid()){
-    jobs_list = JobsList();
+bool JobPlacement::ParseCpuList(const string &list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    if (list.empty()) {
+        return false;
+    }
+    istringstream iss(list);
+    for (string range; getline(iss, range, ',');) {
+        size_t dash = range.find('-');
+        string low = range.substr(0, dash);
+        string high = (dash == FIND_FAIL) ? low : range.substr(dash + 1);
+        if (low.empty() || high.empty() || low.size() > 6 || high.size() > 6 ||
+            !IsStringNumber(low) || !IsStringNumber(high) || low[0] == '-' || high[0] == '-') {
+            return false;
+        }
+        int first = stoi(low);
+        int last = stoi(high);
+        if (first > last || last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (int cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+    }
+    return CPU_COUNT(set) > 0;
 }
 
-SmallShell::~SmallShell() {
-    if (last_dir != nullptr) {
-        delete[] last_dir;
+string JobPlacement::CpuListString(const cpu_set_t *set) {
+    string list = "";
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, set)) {
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) {
+            last++;
+        }
+        if (!list.empty()) {
+            list += ",";
+        }
+        list += to_string(cpu);
+        if (last != cpu) {
+            list += "-" + to_string(last);
+        }
+        cpu = last;
     }
+    return list;
 }
 
-Command * SmallShell::CreateCommand(const char *cmd_line, bool is_special, bool is_piped, bool is_timeout) {
-    char* cmd = new char[strlen(cmd_line) + 1];
-    strcpy(cmd, cmd_line);
-    string first_word = GetFirstStringInCmdLine(cmd_line);
-    if (first_word.compare("") == 0) {
-        return nullptr;
+void JobPlacement::SetCpus(const cpu_set_t &set) {
+    cpus = set;
+    has_cpus = true;
+}
+
+void JobPlacement::SetNumaNode(int node) {
+    numa_node = node;
+}
+
+void JobPlacement::Merge(const JobPlacement &other) {
+    if (other.has_cpus) {
+        SetCpus(other.cpus);
     }
-    if (!is_special && IsRedirectionCommand(cmd_line)) {
-        return new RedirectionCommand(cmd);
+    if (other.numa_node != -1) {
+        numa_node = other.numa_node;
     }
-    if (IsPipeCommand(cmd_line)) {
-        return new PipeCommand(cmd);
+}
+
+void JobPlacement::Apply() const {
+    if (has_cpus && sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+        perror("smash error: sched_setaffinity failed");
     }
-    if (first_word.compare("chprompt") == 0) {
-        return new ChpromptCommand(cmd);
+    if (numa_node != -1) {
+        const int bits = 8 * sizeof(unsigned long);
+        unsigned long node_mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+        node_mask[numa_node / bits] |= 1UL << (numa_node % bits);
+        if (syscall(SYS_set_mempolicy, MPOL_BIND, node_mask, NUMA_MAX_NODES + 1) != 0) {
+            perror("smash error: set_mempolicy failed");
+        }
     }
-    if  (first_word.compare("ls") == 0) {
-        return new LsCommand(cmd);
+}
+
+string JobPlacement::Describe() const {
+    if (IsEmpty()) {
+        return "any";
     }
-    if (first_word.compare("showpid") == 0) {
-        return new ShowPidCommand(cmd);
+    string description = "";
+    if (has_cpus) {
+        description += "cpus=" + CpuListString(&cpus);
     }
-    if (first_word.compare("pwd") == 0) {
-        return new GetCurrDirCommand(cmd);
+    if (numa_node != -1) {
+        description += (has_cpus ? " " : "");
+        description += "numa=" + to_string(numa_node);
     }
-    if (first_word.compare("cd") == 0) {
-        return new ChangeDirCommand(cmd);
+    return description;
+}
+
+bool WriteCgroupFile(const string &path, const string &value) {
+    int fd = open(path.c_str(), O_WRONLY);
+    if (fd == FAIL) {
+        return false;
     }
-    if (first_word.compare("jobs") == 0) {
-        return new JobsCommand(cmd);
+    bool written = (write(fd, value.c_str(), value.size()) == (ssize_t) value.size());
+    close(fd);
+    return written;
+}
+
+string ReadCgroupValue(const string &path, const string &key = "") {
+    ifstream file(path);
+    for (string line; getline(file, line);) {
+        if (key.empty()) {
+            return _trim(line);
+        }
+        if (line.compare(0, key.size() + 1, key + " ") == 0) {
+            return _trim(line.substr(key.size() + 1));
+        }
     }
-    if (first_word.compare("kill") == 0) {
-        return new KillCommand(cmd);
+    return "?";
+}
+
+JobLimits::JobLimits() : mem_bytes(-1), cpu_percent(-1), max_pids(-1), cgroup_path("") {}
+
+bool JobLimits::ParseOption(const string &option, const string &value) {
+    if (option == "--mem") {
+        return ParseSize(value, &mem_bytes);
     }
-    if (first_word.compare("fg") == 0) {
-        return new ForegroundCommand(cmd);
+    string number = value;
+    if (option == "--cpu" && !number.empty() && number.back() == '%') {
+        number.pop_back();
     }
-    if (first_word.compare("bg") == 0) {
-        return new BackgroundCommand(cmd);
-    }
-    if (first_word.compare("cp") == 0){
-        return new CopyCommand(cmd);
+    if (number.empty() || number.size() > 6 || number[0] == '-' || !IsStringNumber(number) || stoi(number) == 0) {
+        return false;
     }
-    if (first_word.compare("quit") == 0) {
-        return new QuitCommand(cmd);
+    if (option == "--cpu") {
+        cpu_percent = stoi(number);
+        return true;
     }
-    if (!is_timeout && first_word.compare("timeout") == 0) {
-        return new TimeoutCommand(cmd);
+    if (option == "--pids") {
+        max_pids = stoll(number);
+        return true;
     }
-    return new ExternalCommand(cmd, is_piped);
+    return false;
 }
 
-void SmallShell::ExecuteCommand(const char* cmd_line, bool is_special, bool is_piped, bool is_timeout) {
-    Command* cmd = CreateCommand(cmd_line, is_special, is_piped, is_timeout);
-    if(cmd != nullptr) {
-        cmd->execute();
+void JobLimits::Merge(const JobLimits &other) {
+    mem_bytes = (other.mem_bytes != -1) ? other.mem_bytes : mem_bytes;
+    cpu_percent = (other.cpu_percent != -1) ? other.cpu_percent : cpu_percent;
+    max_pids = (other.max_pids != -1) ? other.max_pids : max_pids;
+}
+
+void JobLimits::Prepare() {
+    static int next_leaf = 0;
+    cgroup_path = "";
+    if (IsEmpty()) {
+        return;
     }
-    else {
-        // Do something later
+    string root = GlobalSmash().GetCgroupRoot();
+    if (root.empty()) {
+        return;
+    }
+    string leaf = root + "/job-" + to_string(++next_leaf);
+    if (mkdir(leaf.c_str(), 0755) != 0) {
+        return;
+    }
+    bool limited = true;
+    if (mem_bytes != -1) {
+        limited = limited && WriteCgroupFile(leaf + "/memory.max", to_string(mem_bytes));
+    }
+    if (cpu_percent != -1) {
+        long long quota = (long long) cpu_percent * CGROUP_CPU_PERIOD / 100;
+        limited = limited && WriteCgroupFile(leaf + "/cpu.max", to_string(quota) + " " + to_string(CGROUP_CPU_PERIOD));
     }
+    if (max_pids != -1) {
+        limited = limited && WriteCgroupFile(leaf + "/pids.max", to_string(max_pids));
+    }
+    if (!limited) { // controllers are not delegated to us, fall back to rlimits
+        rmdir(leaf.c_str());
+        if (max_pids != -1) {
+            cout << "smash error: limit: pids.max is not writable, --pids is not applied" << endl;
+        }
+        return;
+    }
+    cgroup_path = leaf;
 }
 
-string SmallShell::GetPrompt() {
-    return (prompt + ">");
+void JobLimits::Apply() const {
+    if (IsEmpty()) {
+        return;
+    }
+    if (!cgroup_path.empty() && WriteCgroupFile(cgroup_path + "/cgroup.procs", to_string(getpid()))) {
+        return;
+    }
+    struct rlimit limit;
+    if (mem_bytes != -1) {
+        limit.rlim_cur = limit.rlim_max = mem_bytes;
+        if (setrlimit(RLIMIT_AS, &limit) != 0) {
+            perror("smash error: setrlimit failed");
+        }
+    }
 }
 
-char *SmallShell::GetLastDir() {
-    return last_dir;
+void JobLimits::Release() {
+    if (!cgroup_path.empty() && rmdir(cgroup_path.c_str()) == 0) {
+        cgroup_path = "";
+    }
 }
 
-JobsList *SmallShell::GetJobsList() {
-    return &jobs_list;
+string JobLimits::Describe() const {
+    if (IsEmpty()) {
+        return "none";
+    }
+    string description = "";
+    if (mem_bytes != -1) {
+        description += "mem=" + to_string(mem_bytes) + " ";
+    }
+    if (cpu_percent != -1) {
+        description += "cpu=" + to_string(cpu_percent) + "% ";
+    }
+    if (max_pids != -1) {
+        description += "pids=" + to_string(max_pids) + " ";
+    }
+    if (!cgroup_path.empty()) {
+        return description + "(cgroup " + cgroup_path + ")";
+    }
+    string missing = string(cpu_percent != -1 ? " cpu" : "") + (max_pids != -1 ? " pids" : "");
+    return description + (missing.empty() ? "(rlimit)" : "(rlimit," + missing + " not enforced)");
 }
 
-JobsList::JobEntry *SmallShell::GetForeGroundJob() {
-    return fore_ground_job;
+string JobLimits::Usage() const {
+    if (cgroup_path.empty()) {
+        return "";
+    }
+    return "mem=" + ReadCgroupValue(cgroup_path + "/memory.current") +
+           " cpu_usec=" + ReadCgroupValue(cgroup_path + "/cpu.stat", "usage_usec") +
+           " pids=" + ReadCgroupValue(cgroup_path + "/pids.current");
 }
 
-void SmallShell::SetPrompt(string new_prom) {
-    prompt = new_prom;
+JobStateTable::JobStateTable() : fore_ground_pid(0), interrupted(false) {
+    static_assert(ATOMIC_INT_LOCK_FREE == 2, "the signal handlers need lock-free atomics");
+    for (int i = 0; i < JOB_TABLE_SIZE; i++) {
+        slots[i].state.store(Free);
+        slots[i].pid = 0;
+        slots[i].cmd_line = nullptr;
+        slots[i].deadline_ns = 0;
+    }
 }
 
-void SmallShell::SetForeGroundJob(JobsList::JobEntry *job) {
-    fore_ground_job = job;
+bool JobStateTable::Register(pid_t pid, const char *cmd_line, long long deadline_ns) {
+    for (int i = 0; i < JOB_TABLE_SIZE; i++) {
+        Slot &slot = slots[(pid + i) % JOB_TABLE_SIZE];
+        int expected = Free;
+        if (slot.state.compare_exchange_strong(expected, Claimed)) {
+            slot.pid = pid;
+            slot.cmd_line = cmd_line;
+            slot.deadline_ns = deadline_ns;
+            slot.state.store(Armed, memory_order_release);
+            return true;
+        }
+    }
+    return false;
 }
 
-void SmallShell::UpdateLastDir(char *new_dir) {
-    if (last_dir == nullptr) {
-        last_dir = new_dir;
-    }
-    else {
-        delete[] last_dir;
-        last_dir = new_dir;
+void JobStateTable::Release(pid_t pid) {
+    for (int i = 0; i < JOB_TABLE_SIZE; i++) {
+        Slot &slot = slots[(pid + i) % JOB_TABLE_SIZE];
+        int state = slot.state.load(memory_order_acquire);
+        if ((state == Armed || state == Fired) && slot.pid == pid) {
+            slot.state.store(Free, memory_order_release);
+            return;
+        }
     }
 }
 
-Command::Command(const char *cmd_line) : cmd_line(cmd_line) {
-    args = vector<string>();
-    num_of_args = ParseCommandLine(cmd_line, args);
+void JobStateTable::NoteInterrupt() {
+    interrupted.store(true);
 }
 
-Command::~Command() {
-    delete[] cmd_line;
+bool JobStateTable::TakeInterrupt() {
+    return interrupted.exchange(false);
 }
 
-BuiltInCommand::BuiltInCommand(const char *cmd_line) : Command(cmd_line) {
-    if (args.back().compare("&") == 0) {
-        args.pop_back();
-        num_of_args--;
-    } else if ((args.back().back()) == '&') {
-        args.back().pop_back();
-        return;
-    }
+void JobStateTable::SetForeground(pid_t pid) {
+    fore_ground_pid.store(pid);
 }
 
-ChpromptCommand::ChpromptCommand(const char *cmd_line) : BuiltInCommand(cmd_line), prompt("smash") {
-    if (num_of_args > 1) {
-        prompt = args.at(1);
-    }
+pid_t JobStateTable::GetForeground() const {
+    return fore_ground_pid.load();
 }
 
-void ChpromptCommand::execute() {
-    global_smash.SetPrompt(this->prompt);
+bool JobStateTable::PopExpired(pid_t *pid, const char **cmd_line) {
+    long long now = MonotonicNanos();
+    for (int i = 0; i < JOB_TABLE_SIZE; i++) {
+        Slot &slot = slots[i];
+        int expected = Armed;
+        if (slot.state.load(memory_order_acquire) == Armed && slot.deadline_ns <= now &&
+            slot.state.compare_exchange_strong(expected, Fired)) {
+            *pid = slot.pid;
+            *cmd_line = slot.cmd_line;
+            return true;
+        }
+    }
+    return false;
 }
 
-void LsCommand::execute() {
-    struct dirent **list_names;
-    int num_of_files;
-    num_of_files = scandir(".", &list_names, NULL, alphasort);
-    if (num_of_files < 0) {
-        return;
-    }
-    for(int i = 0 ; i < num_of_files ; i++) {
-        cout << list_names[i]->d_name << endl;
-        free(list_names[i]);
+long long JobStateTable::NanosToClosestDeadline(long long now) const {
+    long long closest = FAIL;
+    for (int i = 0; i < JOB_TABLE_SIZE; i++) {
+        if (slots[i].state.load(memory_order_acquire) != Armed) {
+            continue;
+        }
+        long long left = max(0LL, slots[i].deadline_ns - now);
+        if (closest == FAIL || left < closest) {
+            closest = left;
+        }
     }
-    free(list_names);
+    return closest;
 }
 
-void ShowPidCommand::execute() {
-    cout << "smash pid is " << global_smash.GetSmashPid() << endl;
+// SIGALRM for the closest deadline, or limit_ns from now when that comes first
+void JobStateTable::ArmAlarm(long long limit_ns) const {
+    long long closest = NanosToClosestDeadline(MonotonicNanos());
+    if (closest == FAIL || (limit_ns != FAIL && limit_ns < closest)) {
+        closest = limit_ns;
+    }
+    if (closest != FAIL) {
+        struct itimerval timer;
+        memset(&timer, 0, sizeof(timer));
+        closest = max(closest, 1000LL); // a zero timer would cancel instead of firing
+        timer.it_value.tv_sec = closest / NANOS_PER_SECOND;
+        timer.it_value.tv_usec = (closest % NANOS_PER_SECOND + 999) / 1000;
+        setitimer(ITIMER_REAL, &timer, nullptr);
+    }
 }
 
-void GetCurrDirCommand::execute() {
-    char *path = new char[sizeof(char) * PATH_MAX];
-    char *temp_path = getcwd(path, PATH_MAX);
-    if (temp_path != NULL) {
-        cout << temp_path << endl;
-    } else {
-        perror("smash error: getcwd failed");
+Environment::Environment() : envp_dirty(true) {
+    for (char **var = environ; var != nullptr && *var != nullptr; var++) {
+        const string entry = *var;
+        size_t equal = entry.find('=');
+        if (equal != FIND_FAIL) {
+            variables[entry.substr(0, equal)] = entry.substr(equal + 1);
+        }
     }
-    delete[] temp_path;
 }
 
-void ChangeDirCommand::AuxOfExe(string &str) {
-    char *path;
-    if (str.compare("-") == 0) {
-        path = global_smash.GetLastDir();
+bool Environment::IsValidName(const string &name) {
+    if (name.empty() || isdigit(name[0])) {
+        return false;
     }
-    else {
-        path = new char[str.length() + 1];
-        strcpy(path, str.c_str());
+    for (size_t i = 0; i < name.size(); i++) {
+        if (!isalnum(name[i]) && name[i] != '_') {
+            return false;
+        }
     }
-    if (path == nullptr) {
-        cout << "smash error: cd: OLDPWD not set" << endl;
-        return;
+    return true;
+}
+
+void Environment::Set(const string &name, const string &value) {
+    locals.erase(name);
+    variables[name] = value;
+    envp_dirty = true;
+}
+
+// an exported name stays exported, like bash, anything else leaves the cached envp alone
+void Environment::SetLocal(const string &name, const string &value) {
+    unordered_map<string, string>::iterator it = variables.find(name);
+    if (it == variables.end()) {
+        locals[name] = value;
     }
-    else {
-        char *path_2 = new char[sizeof(char) * PATH_MAX];
-        char *curr_path =  getcwd(path_2, PATH_MAX);
-        if (curr_path == NULL) {
-            perror("smash error: getcwd failed");
-            return;
-        }
-        if (chdir(path) != 0) {
-            delete[] curr_path;
-            perror("smash error: chdir failed");
-            return;
-        }
-        else {
-            global_smash.UpdateLastDir(curr_path);
-        }
+    else if (it->second != value) {
+        it->second = value;
+        envp_dirty = true;
     }
 }
 
-void ChangeDirCommand::execute() {
-    switch (num_of_args) {
-        case 1:
-            break;
-        case 2:
-            AuxOfExe(args.at(1));
-            break;
-        default:
-            cout << "smash error: cd: too many arguments" << endl;
-            break;
+void Environment::Unset(const string &name) {
+    locals.erase(name);
+    if (variables.erase(name) > 0) {
+        envp_dirty = true;
     }
 }
 
-void JobsCommand::execute() {
-    JobsList *jobs_list = global_smash.GetJobsList();
-    jobs_list->PrintJobsList();
+bool Environment::Get(const string &name, string *value) const {
+    unordered_map<string, string>::const_iterator it = variables.find(name);
+    if (it == variables.end()) {
+        it = locals.find(name);
+        if (it == locals.end()) {
+            return false;
+        }
+    }
+    *value = it->second;
+    return true;
 }
 
-void KillCommand::execute() {
-    if(num_of_args != 3) {
-        cout << "smash error: kill: invalid arguments" << endl;
-        return;
+char **Environment::GetEnvp() {
+    if (!envp_dirty) {
+        return envp.data();
     }
-    string sig = args.at(1);
-    if (sig[0] != '-' || !IsStringNumber(sig.erase(0,1)) || !IsStringNumber(args.at(2))) {
-        cout << "smash error: kill: invalid arguments" << endl;
-        return;
+    env_strings.clear();
+    envp.clear();
+    env_strings.reserve(variables.size());
+    for (unordered_map<string, string>::const_iterator it = variables.begin(); it != variables.end(); ++it) {
+        env_strings.push_back(it->first + "=" + it->second);
     }
-    global_smash.GetJobsList()->RemoveFinishedJobs();
-    int job_id = stoi(args.at(2));
-    int sig_num = stoi(sig);
-    if (!global_smash.GetJobsList()->JobIdExists(job_id)) {
-        cout << "smash error: kill: job-id " << job_id << " does not exist" << endl;
-        return;
+    for (size_t i = 0; i < env_strings.size(); i++) {
+        envp.push_back((char *) env_strings[i].c_str());
     }
-    pid_t pid = global_smash.GetJobsList()->GetJobPidByJobId(job_id);
-    if(killpg(pid, sig_num) != 0) {
-        perror("smash error: kill failed");
+    envp.push_back(nullptr);
+    envp_dirty = false;
+    return envp.data();
+}
+
+// reads the name of the $?, $NAME or ${NAME} reference at pos ("?" for $?) and leaves pos on its last character
+bool Environment::ParseVariable(const string &line, size_t &pos, string* name) {
+    if (line[pos] != '$' || pos + 1 == line.size()) {
+        return false;
+    }
+    if (line[pos + 1] == '?') {
+        *name = "?";
+        pos++;
+        return true;
+    }
+    size_t start = pos + 1;
+    size_t end = start;
+    bool braced = (line[start] == '{');
+    if (braced) {
+        end = line.find('}', start);
+        if (end == FIND_FAIL || !IsValidName(line.substr(start + 1, end - start - 1))) {
+            return false;
+        }
     }
     else {
-        cout << "signal number " << sig_num << " was sent to pid " << pid << endl;
+        while (end < line.size() && (isalnum(line[end]) || line[end] == '_')) {
+            end++;
+        }
+        if (end == start || isdigit(line[start])) {
+            return false;
+        }
     }
+    *name = braced ? line.substr(start + 1, end - start - 1) : line.substr(start, end - start);
+    pos = braced ? end : end - 1;
+    return true;
 }
 
-void ForegroundCommand::execute() {
-    if (num_of_args != 1 && num_of_args != 2) {
-        cout << "smash error: fg: invalid arguments" << endl;
-        return;
+bool Environment::ExpandVariable(const string &line, size_t &pos, int last_status, string* value) const {
+    string name;
+    if (!ParseVariable(line, pos, &name)) {
+        return false;
     }
-    int job_id_to_foreground = -1;
-
-    if(global_smash.GetJobsList()->IsEmpty()) { // ***
-        cout << "smash error: fg: jobs list is empty" << endl;
-        return;
+    value->clear();
+    if (name == "?") {
+        *value = to_string(last_status);
     }
-    if(num_of_args == 1) {
-        job_id_to_foreground = global_smash.GetJobsList()->GetMaxJobId(); // ***
+    else {
+        Get(name, value);
     }
-    if(num_of_args == 2) {
-        if(!IsStringNumber(args.at(1))) {
-            cout << "smash error: fg: invalid arguments" << endl;
-            return;
+    return true;
+}
+
+string Environment::Expand(const string &line, int last_status) const {
+    if (line.find('$') == FIND_FAIL) {
+        return line;
+    }
+    string expanded;
+    string value;
+    for (size_t i = 0; i < line.size(); i++) {
+        if (ExpandVariable(line, i, last_status, &value)) {
+            expanded += value;
         }
-        job_id_to_foreground = stoi(args.at(1));
-        if(!global_smash.GetJobsList()->JobIdExists(job_id_to_foreground)) { // ***
-            cout << "smash error: fg: job-id " << job_id_to_foreground << " does not exist" << endl;
-            return;
+        else {
+            expanded.push_back(line[i]);
         }
     }
-    JobsList::JobEntry *job_to_foreground = global_smash.GetJobsList()->RemoveJobByJobId(job_id_to_foreground);
-    pid_t pid = job_to_foreground->GetJobPid();
-    if (killpg(pid, SIGCONT) != 0) {
-        perror("smash error: kill failed");
-        return;
+    return expanded;
+}
+
+void Environment::Print(ostream &out) const {
+    vector<string> names;
+    for (unordered_map<string, string>::const_iterator it = variables.begin(); it != variables.end(); ++it) {
+        names.push_back(it->first);
     }
-    cout << job_to_foreground->GetCommand()->GetCmdLine() << " : " << pid << endl;
-    global_smash.SetForeGroundJob(job_to_foreground);
-    if(waitpid(pid, NULL, WUNTRACED) < 0) {
-        perror("smash error: waitpid failed");
-        return;
+    sort(names.begin(), names.end());
+    for (size_t i = 0; i < names.size(); i++) {
+        out << "export " << names[i] << "=" << variables.at(names[i]) << endl;
     }
-    if(!global_smash.GetJobsList()->JobPidExists(pid)) { // ***
-        delete job_to_foreground;
+}
+
+ScriptBlock::~ScriptBlock() {
+    for (size_t i = 0; i < nodes.size(); i++) {
+        delete nodes[i];
     }
-    global_smash.SetForeGroundJob(nullptr);
+}
 
+void ScriptBlock::Add(ScriptNode *node) {
+    nodes.push_back(node);
 }
 
-void BackgroundCommand::execute() {
-    if (num_of_args != 1 && num_of_args != 2) {
-        cout << "smash error: bg: invalid arguments" << endl;
-        return;
-    }
-    int job_id_to_background = -1;
-    if(num_of_args == 1) {
-        job_id_to_background = global_smash.GetJobsList()->GetMaxStoppedJobId(); // Return the Max id from the Stop jobs else 0
-        if(job_id_to_background == 0) {
-            cout << "smash error: bg: there is no stopped jobs to resume" << endl;
-            return;
+ScriptFlow ScriptBlock::Run() {
+    for (size_t i = 0; i < nodes.size(); i++) {
+        ScriptFlow flow = nodes[i]->Run();
+        if (flow != FlowNext) {
+            return flow;
         }
     }
-    if(num_of_args == 2) {
-        if(!IsStringNumber(args.at(1))) {
-            cout << "smash error: bg: invalid arguments" << endl;
-            return;
+    return FlowNext;
+}
+
+// runs one command line, FlowAbort once ctrl-C was pressed
+ScriptFlow RunScriptLine(const CompiledCommand &command) {
+    if (GlobalSmash().GetJobStateTable()->TakeInterrupt()) {
+        return FlowAbort;
+    }
+    GlobalSmash().RunCompiled(command);
+    return GlobalSmash().GetJobStateTable()->TakeInterrupt() ? FlowAbort : FlowNext;
+}
+
+ScriptFlow ScriptCommandNode::Run() {
+    return RunScriptLine(*command);
+}
+
+ScriptIfNode::~ScriptIfNode() {
+    for (size_t i = 0; i < branches.size(); i++) {
+        delete branches[i].first;
+        delete branches[i].second;
+    }
+    delete else_block;
+}
+
+ScriptBlock *ScriptIfNode::AddBranch(const string &condition) {
+    branches.push_back(make_pair(CompiledCommand::Compile(condition), new ScriptBlock()));
+    return branches.back().second;
+}
+
+ScriptBlock *ScriptIfNode::AddElse() {
+    else_block = new ScriptBlock();
+    return else_block;
+}
+
+ScriptFlow ScriptIfNode::Run() {
+    for (size_t i = 0; i < branches.size(); i++) {
+        if (RunScriptLine(*branches[i].first) == FlowAbort) {
+            return FlowAbort;
         }
-        job_id_to_background = stoi(args.at(1));
+        if (GlobalSmash().GetLastStatus() == 0) {
+            return branches[i].second->Run();
+        }
+    }
+    return (else_block != nullptr) ? else_block->Run() : FlowNext;
+}
 
-        if(!global_smash.GetJobsList()->JobIdExists(job_id_to_background)) { // ***
-            cout << "smash error: bg: job-id " << job_id_to_background << " does not exist" << endl;
-            return;
+ScriptFlow ScriptWhileNode::Run() {
+    while (true) {
+        if (RunScriptLine(*condition) == FlowAbort) {
+            return FlowAbort;
         }
-        JobsList::JobEntry *job_to_background = global_smash.GetJobsList()->GetJobById(job_id_to_background); // ***
-        if(job_to_background->GetState() == Background) {
-            cout << "smash error: bg: job-id " << job_id_to_background << " is already running in the background" << endl;
-            return;
+        if (GlobalSmash().GetLastStatus() != 0) {
+            break;
+        }
+        ScriptFlow flow = body.Run();
+        if (flow == FlowBreak) {
+            break;
+        }
+        if (flow == FlowAbort) {
+            return FlowAbort;
         }
     }
-    JobsList::JobEntry *job_to_background = global_smash.GetJobsList()->GetJobById(job_id_to_background);
-    pid_t pid = job_to_background->GetJobPid();
-    cout << job_to_background->GetCommand()->GetCmdLine() << " : " << pid << endl;
-    if (killpg(pid, SIGCONT) != 0) {
-        perror("smash error: kill failed");
-        return;
+    GlobalSmash().SetLastStatus(0);
+    return FlowNext;
+}
+
+ScriptForNode::ScriptForNode(const string &variable, const string &words) : variable(variable), words(words) {
+    string error;
+    lexed = LexWords(words, lexed_words, &error);
+}
+
+ScriptFlow ScriptForNode::Run() {
+    vector<string> values;
+    if (!lexed) {
+        GlobalSmash().ExpandWords(words, values, 0); // reports the syntax error
+        return FlowAbort;
     }
-    job_to_background->SetState(Background);
+    GlobalSmash().ExpandLexed(lexed_words, values, 0);
+    for (size_t i = 0; i < values.size(); i++) {
+        GlobalSmash().GetEnvironment()->SetLocal(variable, values[i]);
+        ScriptFlow flow = body.Run();
+        if (flow == FlowBreak) {
+            break;
+        }
+        if (flow == FlowAbort) {
+            return FlowAbort;
+        }
+    }
+    return FlowNext;
+}
 
+ScriptCompiler::~ScriptCompiler() {
+    delete root;
 }
 
-void QuitCommand::execute() {
-    if(num_of_args > 1 && args.at(1) == "kill") {
-        global_smash.GetJobsList()->RemoveFinishedJobs();
-        cout << "smash: sending SIGKILL signal to " << global_smash.GetJobsList()->GetSize() << " jobs:" << endl;
-        global_smash.GetJobsList()->jobs_list.sort(JobsCmpSmallerId);
-        for (list<JobsList::JobEntry*>::iterator it = global_smash.GetJobsList()->jobs_list.begin();
-        it != global_smash.GetJobsList()->jobs_list.end(); it++) {
-            cout << (*it)->GetJobPid() << ": " << (*it)->GetCommand()->GetCmdLine() << endl;
+void ScriptCompiler::Reset() {
+    frames.clear();
+    delete root;
+    root = nullptr;
+}
+
+bool ScriptCompiler::InLoop() const {
+    for (size_t i = 0; i < frames.size(); i++) {
+        if (frames[i].keyword != "if") {
+            return true;
         }
-        global_smash.GetJobsList()->KillAllJobs();
     }
-    exit(0);
+    return false;
 }
 
-void ExternalCommand::execute() {
-    char* cmd_line = new char[COMMAND_MAX_LENGTH + 1];
-    strcpy(cmd_line,GetCmdLine());
-    bool is_cmd_background = IsBackgroundCommand(cmd_line);
-    bool is_cmd_timeout = IsTimeoutCommand(cmd_line);
-    bool is_cmd_red = IsRedirectionCommand(cmd_line);
-    if(is_cmd_background) {
-        RemoveBackgroundSign(cmd_line);
+bool ScriptCompiler::FeedStatement(const string &statement) {
+    vector<string> words;
+    if (ParseCommandLine(statement, words) == 0) {
+        return true;
     }
-    if(is_cmd_red) {
-        RemoveRedirectionSign(cmd_line);
+    const string &keyword = words[0];
+    string rest = _trim(statement.substr(statement.find(keyword) + keyword.size()));
+    ScriptBlock *block = frames.empty() ? root : frames.back().block;
+    string open = frames.empty() ? "" : frames.back().keyword;
+    if (keyword == "if" || keyword == "while") {
+        if (rest.empty()) {
+            return false;
+        }
+        Frame frame = {keyword, nullptr, nullptr};
+        if (keyword == "if") {
+            ScriptIfNode *node = new ScriptIfNode();
+            frame.node = node;
+            frame.block = node->AddBranch(rest);
+        }
+        else {
+            ScriptWhileNode *node = new ScriptWhileNode(rest);
+            frame.node = node;
+            frame.block = node->GetBody();
+        }
+        block->Add(frame.node);
+        frames.push_back(frame);
+        return true;
     }
-    if(is_cmd_timeout) {
-        RemoveTimeoutSign(cmd_line);
+    if (keyword == "for") {
+        if (words.size() < 3 || words[2] != "in" || !Environment::IsValidName(words[1])) {
+            return false;
+        }
+        size_t in_pos = statement.find(" in", statement.find(words[1], statement.find(keyword) + keyword.size()));
+        ScriptForNode *node = new ScriptForNode(words[1], statement.substr(in_pos + 3));
+        block->Add(node);
+        Frame frame = {keyword, node, node->GetBody()};
+        frames.push_back(frame);
+        return true;
+    }
+    if (keyword == "then" || keyword == "do") {
+        if ((keyword == "then") != (open == "if") || open.empty()) {
+            return false;
+        }
+        return rest.empty() || FeedStatement(rest);
+    }
+    if (keyword == "elif" || keyword == "else") {
+        ScriptIfNode *node = (open == "if") ? (ScriptIfNode *) frames.back().node : nullptr;
+        if (node == nullptr || node->HasElse() || (keyword == "elif" && rest.empty())) {
+            return false;
+        }
+        if (keyword == "elif") {
+            frames.back().block = node->AddBranch(rest);
+            return true;
+        }
+        frames.back().block = node->AddElse();
+        return rest.empty() || FeedStatement(rest);
+    }
+    if (keyword == "fi" || keyword == "done") {
+        if (open.empty() || (keyword == "fi") != (open == "if")) {
+            return false;
+        }
+        frames.pop_back();
+        return true;
+    }
+    if (keyword == "break" || keyword == "continue") {
+        if (!InLoop()) {
+            return false;
+        }
+        block->Add(new ScriptJumpNode(keyword == "break" ? FlowBreak : FlowContinue));
+        return true;
+    }
+    block->Add(new ScriptCommandNode(statement));
+    return true;
+}
+
+bool ScriptCompiler::Feed(const string &line) {
+    vector<string> words;
+    ParseCommandLine(line, words);
+    if (frames.empty() && !words.empty() && (words[0] == "then" || words[0] == "do" || words[0] == "elif" ||
+                                              words[0] == "else" || words[0] == "fi" || words[0] == "done")) {
+        cout << "smash error: syntax error near unexpected token `" << words[0] << "'" << endl;
+        return true;
+    }
+    if (frames.empty() && (words.empty() || (words[0] != "if" && words[0] != "while" && words[0] != "for"))) {
+        return false;
+    }
+    if (root == nullptr) {
+        root = new ScriptBlock();
+    }
+    size_t start = 0;
+    char quote = 0;
+    for (size_t i = 0; i <= line.size(); i++) { // statements are separated by ';' outside of quotes
+        if (i < line.size() && (line[i] == '\'' || line[i] == '"')) {
+            quote = (quote == 0) ? line[i] : (quote == line[i] ? 0 : quote);
+        }
+        if (i < line.size() && (line[i] != ';' || quote != 0)) {
+            continue;
+        }
+        string statement = _trim(line.substr(start, i - start));
+        start = i + 1;
+        if (!FeedStatement(statement)) {
+            vector<string> bad;
+            ParseCommandLine(statement, bad);
+            cout << "smash error: syntax error near unexpected token `" << (bad.empty() ? ";" : bad[0]) << "'" << endl;
+            Reset();
+            return true;
+        }
+    }
+    if (frames.empty()) {
+        ScriptBlock *script = root;
+        root = nullptr;
+        GlobalSmash().GetJobStateTable()->TakeInterrupt(); // a ctrl-C from before the script doesn't count
+        script->Run();
+        delete script;
+    }
+    return true;
+}
+
+bool Zygote::Start() {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == FAIL) {
+        perror("smash error: socketpair failed");
+        return false;
+    }
+    pid = fork();
+    if (pid == FAIL) {
+        perror("smash error: fork failed");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        setpgid(0, 0); // keep ctrl-C and ctrl-Z from the terminal away from it
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGALRM, SIG_DFL);
+        Serve(fds[1]);
+        _exit(0);
+    }
+    close(fds[1]);
+    sock = fds[0];
+    return true;
+}
+
+void Zygote::Stop() {
+    if (sock == -1) {
+        return;
+    }
+    close(sock); // the zygote exits on end of file
+    sock = -1;
+    waitpid(pid, nullptr, 0);
+    pid = -1;
+}
+
+void Zygote::Serve(int sock) {
+    vector<char> payload(ZYGOTE_MAX_REQUEST);
+    while (true) {
+        char control[CMSG_SPACE(sizeof(int) * ZYGOTE_PASSED_FDS)];
+        struct iovec iov = {payload.data(), payload.size()};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t size = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (size == FAIL && errno == EINTR) {
+            continue;
+        }
+        if (size <= 0) {
+            return;
+        }
+        int fds[ZYGOTE_PASSED_FDS] = {-1, -1, -1, -1};
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        }
+        pid_t child = FAIL;
+        if (fds[ZYGOTE_PASSED_FDS - 1] != -1) {
+            child = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+            if (child == 0) {
+                LaunchChild(payload.data(), size, fds);
+            }
+        }
+        for (int i = 0; i < ZYGOTE_PASSED_FDS; i++) {
+            if (fds[i] != -1) {
+                close(fds[i]);
+            }
+        }
+        send(sock, &child, sizeof(child), 0);
+    }
+}
+
+// payload: "F" or "B", the command line, the argument count, the arguments and then the environment
+void Zygote::LaunchChild(char *payload, size_t size, int fds[ZYGOTE_PASSED_FDS]) {
+    for (int i = 0; i < ZYGOTE_PASSED_FDS - 1; i++) {
+        dup2(fds[i], i);
+    }
+    if (fchdir(fds[ZYGOTE_PASSED_FDS - 1]) == FAIL) {
+        perror("smash error: fchdir failed");
+    }
+    vector<char*> fields;
+    for (size_t i = 0; i < size; i += strlen(payload + i) + 1) {
+        fields.push_back(payload + i);
+    }
+    setpgid(0, 0);
+    if (fields.size() >= 3 && fields[0][0] == 'F') {
+        GlobalSmash().ClaimTerminal();
+    }
+    size_t argc = (fields.size() >= 3) ? strtoul(fields[2], nullptr, 10) : 0;
+    if (fields.size() < 3 + argc) {
+        _exit(1);
+    }
+    vector<char*> argv(fields.begin() + 3, fields.begin() + 3 + argc);
+    argv.push_back(NULL);
+    vector<char*> envp(fields.begin() + 3 + argc, fields.end());
+    envp.push_back(NULL);
+    environ = envp.data();
+    if (argc > 0) { // the words are already expanded, never fall back to parsing the line again
+        execvp(argv[0], argv.data());
+        perror("smash error: execvp failed");
+        _exit(1);
+    }
+    char *bash_argv[] = {(char *) "/bin/bash", (char *) "-c", fields[1], NULL};
+    execv(bash_argv[0], bash_argv);
+    perror("smash error: execv failed");
+    _exit(1);
+}
+
+// returns the launched pid, or FAIL when the command should be forked by smash itself
+pid_t Zygote::Launch(const char *cmd_line, const vector<string> &words, char **envp, bool foreground) {
+    if (sock == -1) {
+        return FAIL;
+    }
+    string payload = string(foreground ? "F" : "B") + '\0' + cmd_line + '\0' + to_string(words.size()) + '\0';
+    for (size_t i = 0; i < words.size(); i++) {
+        payload += words[i] + '\0';
+    }
+    for (char **var = envp; *var != nullptr; var++) {
+        payload += string(*var) + '\0';
+    }
+    if (payload.size() > ZYGOTE_MAX_REQUEST) {
+        return FAIL;
+    }
+    int fds[ZYGOTE_PASSED_FDS] = {0, 1, 2, open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)};
+    if (fds[ZYGOTE_PASSED_FDS - 1] == FAIL) {
+        return FAIL;
+    }
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {(void *) payload.data(), payload.size()};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    pid_t child = FAIL;
+    bool sent = sendmsg(sock, &msg, MSG_NOSIGNAL) != FAIL;
+    close(fds[ZYGOTE_PASSED_FDS - 1]);
+    if (!sent || recv(sock, &child, sizeof(child), 0) != sizeof(child)) {
+        perror("smash error: zygote failed");
+        Stop();
+        return FAIL;
+    }
+    return child;
+}
+
+// true if line has a <<WORD here-document, its body follows on the next lines
+bool HereDocument::Start(const string &line) {
+    size_t pos = line.find("<<");
+    if (pos == FIND_FAIL) {
+        return false;
+    }
+    size_t start = pos + 2;
+    strip_tabs = (start < line.size() && line[start] == '-');
+    start = line.find_first_not_of(WHITESPACE, start + (strip_tabs ? 1 : 0));
+    if (start == FIND_FAIL) {
+        return false;
+    }
+    size_t end = line.find_first_of(WHITESPACE + "<>&|", start);
+    string word = line.substr(start, end - start);
+    expand = (word.find_first_of("'\"") == FIND_FAIL); // a quoted delimiter keeps $ literal
+    word.erase(remove(word.begin(), word.end(), '\''), word.end());
+    word.erase(remove(word.begin(), word.end(), '"'), word.end());
+    if (word.empty()) {
+        return false;
+    }
+    delimiter = word;
+    cmd_line = line.substr(0, pos) + "<<" + word + ((end == FIND_FAIL) ? "" : line.substr(end));
+    body.clear();
+    return true;
+}
+
+// true once the delimiter line is reached
+bool HereDocument::AddLine(const string &line) {
+    size_t start = strip_tabs ? line.find_first_not_of('\t') : 0;
+    string text = (start == FIND_FAIL) ? "" : line.substr(start);
+    if (text == delimiter) {
+        return true;
+    }
+    body += text + "\n";
+    return false;
+}
+
+// the body goes into a sealed memfd that the command reads as its stdin
+int HereDocument::Seal(const Environment &environment, int last_status) {
+    string text = expand ? environment.Expand(body, last_status) : body;
+    Reset();
+    int fd = memfd_create("smash-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == FAIL) {
+        perror("smash error: memfd_create failed");
+        return FAIL;
+    }
+    size_t written = 0;
+    while (written < text.size()) {
+        ssize_t count = write(fd, text.data() + written, text.size() - written);
+        if (count == FAIL) {
+            perror("smash error: write failed");
+            close(fd);
+            return FAIL;
+        }
+        written += count;
+    }
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+void HereDocument::Reset() {
+    cmd_line.clear();
+    delimiter.clear();
+    body.clear();
+}
+
+CoprocEntry::CoprocEntry(const string &name, pid_t pid, int write_fd, int read_fd) : name(name), pid(pid),
+write_fd(write_fd), read_fd(read_fd), input(""), output("") {}
+
+CoprocEntry::~CoprocEntry() {
+    if (write_fd != FAIL) {
+        close(write_fd);
+    }
+    if (read_fd != FAIL) {
+        close(read_fd);
+    }
+}
+
+void CoprocEntry::Service() {
+    char buff[READBLOCK];
+    while (read_fd != FAIL) {
+        ssize_t r_value = read(read_fd, buff, READBLOCK);
+        if (r_value > 0) {
+            output.append(buff, r_value);
+            continue;
+        }
+        if (r_value == FAIL && errno == EINTR) {
+            continue;
+        }
+        if (r_value == FAIL && errno == EAGAIN) {
+            break;
+        }
+        if (r_value == FAIL) {
+            perror("smash error: read failed");
+        }
+        close(read_fd);
+        read_fd = FAIL;
+    }
+    struct sigaction old_action;
+    IgnoreSigpipe(&old_action); // the coprocess may have exited
+    while (write_fd != FAIL && !input.empty()) {
+        ssize_t w_value = write(write_fd, input.c_str(), input.size());
+        if (w_value > 0) {
+            input.erase(0, w_value);
+            continue;
+        }
+        if (w_value == FAIL && errno == EINTR) {
+            continue;
+        }
+        if (w_value == FAIL && errno == EAGAIN) {
+            break;
+        }
+        input.clear();
+        close(write_fd);
+        write_fd = FAIL;
+    }
+    RestoreSigpipe(&old_action);
+}
+
+bool CoprocEntry::Send(const string &data) {
+    if (write_fd == FAIL) {
+        return false;
+    }
+    input += data;
+    Service();
+    return true;
+}
+
+string CoprocEntry::Receive() {
+    Service();
+    string received = output;
+    output.clear();
+    return received;
+}
+
+bool CoprocEntry::IsFinished(JobsList* jobs_list) const {
+    return read_fd == FAIL && output.empty() && !jobs_list->JobPidExists(pid);
+}
+
+JobOutput::JobOutput(int read_fd, int job_id, pid_t pid) : read_fd(read_fd), job_id(job_id), pid(pid),
+ring(JOB_OUTPUT_CAPACITY), start(0), size(0) {
+}
+
+JobOutput::~JobOutput() {
+    if (read_fd != FAIL) {
+        close(read_fd);
+    }
+}
+
+void JobOutput::Service() {
+    while (read_fd != FAIL && size < ring.size()) {
+        size_t end = (start + size) % ring.size();
+        size_t room = min(ring.size() - size, ring.size() - end);
+        ssize_t r_value = read(read_fd, ring.data() + end, room);
+        if (r_value > 0) {
+            size += r_value;
+            continue;
+        }
+        if (r_value == FAIL && errno == EINTR) {
+            continue;
+        }
+        if (r_value == FAIL && errno == EAGAIN) {
+            break;
+        }
+        if (r_value == FAIL) {
+            perror("smash error: read failed");
+        }
+        close(read_fd);
+        read_fd = FAIL;
+    }
+}
+
+string JobOutput::Take() {
+    size_t first = min(size, ring.size() - start);
+    string text(ring.data() + start, first);
+    text.append(ring.data(), size - first);
+    start = 0;
+    size = 0;
+    return text;
+}
+
+GlobPattern::GlobPattern(const string &pattern) {
+    for (size_t i = 0; i < pattern.size(); i++) {
+        Token token;
+        token.type = Literal;
+        token.literal = pattern[i];
+        token.negated = false;
+        if (pattern[i] == '*') {
+            token.type = AnyString;
+            if (!tokens.empty() && tokens.back().type == AnyString) {
+                continue;
+            }
+        }
+        else if (pattern[i] == '?') {
+            token.type = AnyChar;
+        }
+        else if (pattern[i] == '[') {
+            size_t j = i + 1;
+            if (j < pattern.size() && (pattern[j] == '!' || pattern[j] == '^')) {
+                token.negated = true;
+                j++;
+            }
+            size_t first = j;
+            while (j < pattern.size() && (pattern[j] != ']' || j == first)) {
+                char low = pattern[j];
+                char high = low;
+                if (j + 2 < pattern.size() && pattern[j + 1] == '-' && pattern[j + 2] != ']') {
+                    high = pattern[j + 2];
+                    j += 2;
+                }
+                token.ranges.push_back(make_pair(low, high));
+                j++;
+            }
+            if (j < pattern.size()) {
+                token.type = CharClass;
+                i = j;
+            }
+            else { // no closing bracket, '[' is literal
+                token.ranges.clear();
+                token.negated = false;
+            }
+        }
+        tokens.push_back(token);
+    }
+}
+
+bool GlobPattern::TokenMatches(const Token &token, char c) {
+    switch (token.type) {
+        case Literal:
+            return token.literal == c;
+        case AnyChar:
+            return true;
+        case CharClass:
+            for (size_t i = 0; i < token.ranges.size(); i++) {
+                if (token.ranges[i].first <= c && c <= token.ranges[i].second) {
+                    return !token.negated;
+                }
+            }
+            return token.negated;
+        default:
+            return false;
+    }
+}
+
+bool GlobPattern::Matches(const string &name) const {
+    size_t token = 0;
+    size_t pos = 0;
+    size_t star = FIND_FAIL;
+    size_t star_pos = 0;
+    while (pos < name.size()) {
+        if (token < tokens.size() && tokens[token].type == AnyString) {
+            star = token++;
+            star_pos = pos;
+        }
+        else if (token < tokens.size() && TokenMatches(tokens[token], name[pos])) {
+            token++;
+            pos++;
+        }
+        else if (star != FIND_FAIL) { // let the last '*' swallow one more char
+            token = star + 1;
+            pos = ++star_pos;
+        }
+        else {
+            return false;
+        }
+    }
+    while (token < tokens.size() && tokens[token].type == AnyString) {
+        token++;
+    }
+    return token == tokens.size();
+}
+
+bool GlobPattern::HasMagic(const string &word) {
+    size_t open_bracket = word.find('[');
+    return word.find_first_of("*?") != FIND_FAIL ||
+           (open_bracket != FIND_FAIL && word.find(']', open_bracket + 2) != FIND_FAIL);
+}
+
+string JoinPath(const string &prefix, const string &name) {
+    if (prefix.empty()) {
+        return name;
+    }
+    return (prefix.back() == '/') ? prefix + name : prefix + "/" + name;
+}
+
+DirectoryState::DirectoryState() : inotify_fd(FAIL) {
+    char path[PATH_MAX];
+    if (getcwd(path, sizeof(path)) != nullptr) {
+        cwd = path;
+    }
+    const char *pwd = getenv("PWD"); // keep the symlinked name we were started from, like bash
+    struct stat pwd_stat, dot_stat;
+    if (pwd != nullptr && pwd[0] == '/' && stat(pwd, &pwd_stat) == 0 && stat(".", &dot_stat) == 0 &&
+        pwd_stat.st_dev == dot_stat.st_dev && pwd_stat.st_ino == dot_stat.st_ino) {
+        cwd = Resolve(pwd);
+    }
+}
+
+DirectoryState::~DirectoryState() {
+    if (inotify_fd != FAIL) {
+        close(inotify_fd);
+    }
+}
+
+// an absolute path with "." and ".." removed, relative paths start at the logical cwd
+string DirectoryState::Resolve(const string &path) const {
+    string full = (!path.empty() && path[0] == '/') ? path : cwd + "/" + path;
+    vector<string> parts;
+    istringstream iss(full);
+    for (string part; getline(iss, part, '/');) {
+        if (part.empty() || part == ".") {
+            continue;
+        }
+        if (part == "..") {
+            if (!parts.empty()) {
+                parts.pop_back();
+            }
+            continue;
+        }
+        parts.push_back(part);
+    }
+    string resolved;
+    for (size_t i = 0; i < parts.size(); i++) {
+        resolved += "/" + parts[i];
+    }
+    return resolved.empty() ? "/" : resolved;
+}
+
+bool DirectoryState::ChangeDir(const string &path) {
+    string target = Resolve(path);
+    if (chdir(target.c_str()) == 0) {
+        cwd = target;
+        return true;
+    }
+    if (chdir(path.c_str()) != 0) { // the logical path may not exist when the cwd was removed
+        perror("smash error: chdir failed");
+        return false;
+    }
+    char physical[PATH_MAX];
+    cwd = (getcwd(physical, sizeof(physical)) != nullptr) ? physical : target;
+    return true;
+}
+
+void DirectoryState::Forget(const string &dir) {
+    map<string, int>::iterator it = watched.find(dir);
+    if (it != watched.end()) {
+        inotify_rm_watch(inotify_fd, it->second);
+        watched_dirs.erase(it->second);
+        watched.erase(it);
+    }
+    listings.erase(dir);
+    unwatched.erase(dir);
+    recent.remove(dir);
+}
+
+// a watched listing is dropped by its events, an unwatched one is checked against the directory's mtime
+bool DirectoryState::IsStale(const string &dir) const {
+    map<string, struct timespec>::const_iterator it = unwatched.find(dir);
+    if (it == unwatched.end()) {
+        return false;
+    }
+    struct stat dir_stat;
+    return stat(dir.c_str(), &dir_stat) == FAIL || dir_stat.st_mtim.tv_sec != it->second.tv_sec ||
+           dir_stat.st_mtim.tv_nsec != it->second.tv_nsec;
+}
+
+void DirectoryState::ReadEvents() {
+    if (inotify_fd == FAIL) {
+        return;
+    }
+    char events[READBLOCK] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (true) {
+        ssize_t size = read(inotify_fd, events, sizeof(events));
+        if (size <= 0) {
+            return;
+        }
+        for (char *ptr = events; ptr < events + size;
+             ptr += sizeof(struct inotify_event) + ((struct inotify_event *) ptr)->len) {
+            struct inotify_event *event = (struct inotify_event *) ptr;
+            if (event->mask & IN_Q_OVERFLOW) { // events were lost, drop every listing
+                while (!recent.empty()) {
+                    Forget(recent.front());
+                }
+                continue;
+            }
+            map<int, string>::iterator dir = watched_dirs.find(event->wd);
+            if (dir != watched_dirs.end()) {
+                Forget(string(dir->second));
+            }
+        }
+    }
+}
+
+const vector<DirEntry> *DirectoryState::List(const string &dir) {
+    ReadEvents();
+    string path = Resolve(dir);
+    map<string, vector<DirEntry> >::iterator cached = listings.find(path);
+    if (cached != listings.end() && !IsStale(path)) {
+        recent.remove(path);
+        recent.push_front(path);
+        return &cached->second;
+    }
+    if (cached != listings.end()) {
+        Forget(path);
+    }
+    struct stat dir_stat; // taken before reading, a change while reading moves the mtime past it
+    bool has_stat = stat(path.c_str(), &dir_stat) == 0;
+    DIR *dir_stream = opendir(path.c_str());
+    if (dir_stream == NULL) {
+        return nullptr;
+    }
+    vector<DirEntry> entries;
+    for (struct dirent *entry = readdir(dir_stream); entry != NULL; entry = readdir(dir_stream)) {
+        DirEntry dir_entry = {entry->d_name, entry->d_type == DT_DIR, entry->d_type == DT_LNK};
+        if (dir_entry.name == "." || dir_entry.name == "..") {
+            continue;
+        }
+        if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
+            struct stat entry_stat;
+            string entry_path = JoinPath(path, dir_entry.name);
+            dir_entry.is_dir = stat(entry_path.c_str(), &entry_stat) == 0 && S_ISDIR(entry_stat.st_mode);
+            dir_entry.is_link = lstat(entry_path.c_str(), &entry_stat) == 0 && S_ISLNK(entry_stat.st_mode);
+        }
+        entries.push_back(dir_entry);
+    }
+    closedir(dir_stream);
+    sort(entries.begin(), entries.end(), [](const DirEntry &a, const DirEntry &b) {
+        return strcoll(a.name.c_str(), b.name.c_str()) < 0;
+    });
+    if (inotify_fd == FAIL) {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    }
+    int wd = (inotify_fd == FAIL) ? FAIL : inotify_add_watch(inotify_fd, path.c_str(),
+            IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    // out of watches (ENOSPC) or no inotify at all: fall back to the mtime, but not for a directory changed in
+    // the last second, where another change could leave the same mtime behind on a coarse clock
+    if (wd == FAIL && (!has_stat || dir_stat.st_mtime >= time(nullptr) - 1)) {
+        uncached = entries;
+        return &uncached;
+    }
+    if (recent.size() >= DIRECTORY_CACHED_LISTINGS) {
+        Forget(string(recent.back()));
+    }
+    if (wd == FAIL) {
+        unwatched[path] = dir_stat.st_mtim;
+    }
+    else {
+        watched[path] = wd;
+        watched_dirs[wd] = path;
+    }
+    recent.push_front(path);
+    listings[path] = entries;
+    return &listings[path];
+}
+
+const vector<DirEntry> *GlobExpander::ListDir(const string &dir) {
+    return GlobalSmash().GetDirectoryState()->List(dir);
+}
+
+void GlobExpander::ExpandSegments(const string &prefix, const vector<string> &segments, size_t index,
+                                  vector<string> &results) {
+    if (index == segments.size()) {
+        if (!prefix.empty()) {
+            results.push_back(prefix);
+        }
+        return;
+    }
+    const string &segment = segments[index];
+    bool last = (index + 1 == segments.size());
+    if (!GlobPattern::HasMagic(segment)) {
+        string path = JoinPath(prefix, segment);
+        struct stat path_stat;
+        if (!last || lstat(path.c_str(), &path_stat) == 0) {
+            ExpandSegments(path, segments, index + 1, results);
+        }
+        return;
+    }
+    const vector<DirEntry> *entries = ListDir(prefix.empty() ? "." : prefix);
+    if (entries == nullptr) {
+        return;
+    }
+    if (segment == "**") { // any number of directories, never following symlinks
+        if (!last) {
+            ExpandSegments(prefix, segments, index + 1, results);
+        }
+        vector<DirEntry> snapshot = *entries; // recursion may refresh the cache
+        for (size_t i = 0; i < snapshot.size(); i++) {
+            if (snapshot[i].name[0] == '.') {
+                continue;
+            }
+            string path = JoinPath(prefix, snapshot[i].name);
+            if (last) {
+                results.push_back(path);
+            }
+            if (snapshot[i].is_dir && !snapshot[i].is_link) {
+                ExpandSegments(path, segments, index, results);
+            }
+        }
+        return;
+    }
+    GlobPattern pattern(segment);
+    vector<DirEntry> matches;
+    for (size_t i = 0; i < entries->size(); i++) {
+        const DirEntry &entry = (*entries)[i];
+        if (entry.name[0] == '.' && segment[0] != '.') {
+            continue;
+        }
+        if ((last || entry.is_dir) && pattern.Matches(entry.name)) {
+            matches.push_back(entry);
+        }
+    }
+    for (size_t i = 0; i < matches.size(); i++) {
+        ExpandSegments(JoinPath(prefix, matches[i].name), segments, index + 1, results);
+    }
+}
+
+vector<string> GlobExpander::Expand(const string &word) {
+    vector<string> results;
+    if (!GlobPattern::HasMagic(word)) {
+        results.push_back(word);
+        return results;
+    }
+    vector<string> segments;
+    istringstream iss(word);
+    for (string segment; getline(iss, segment, '/');) {
+        if (!segment.empty()) {
+            segments.push_back(segment);
+        }
+    }
+    ExpandSegments(word[0] == '/' ? "/" : "", segments, 0, results);
+    if (results.empty()) { // like bash without nullglob, an unmatched pattern stays as is
+        results.push_back(word);
+        return results;
+    }
+    sort(results.begin(), results.end());
+    results.erase(unique(results.begin(), results.end()), results.end());
+    return results;
+}
+
+CompletionTrie::CompletionTrie() {
+    nodes.push_back(Node());
+    nodes[0].count = 0;
+}
+
+void CompletionTrie::Insert(const string &word) {
+    int node = 0;
+    for (size_t i = 0; i < word.size(); i++) {
+        map<char, int>::iterator child = nodes[node].children.find(word[i]);
+        if (child == nodes[node].children.end()) {
+            nodes.push_back(Node());
+            nodes.back().count = 0;
+            nodes[node].children[word[i]] = nodes.size() - 1;
+            node = nodes.size() - 1;
+        }
+        else {
+            node = child->second;
+        }
+    }
+    nodes[node].count++;
+}
+
+void CompletionTrie::Remove(const string &word) { // the nodes stay, a later insert reuses them
+    int node = 0;
+    for (size_t i = 0; i < word.size(); i++) {
+        map<char, int>::iterator child = nodes[node].children.find(word[i]);
+        if (child == nodes[node].children.end()) {
+            return;
+        }
+        node = child->second;
+    }
+    if (nodes[node].count > 0) {
+        nodes[node].count--;
+    }
+}
+
+void CompletionTrie::CollectFrom(int node, string &word, vector<string> &matches) const {
+    if (nodes[node].count > 0) {
+        matches.push_back(word);
+    }
+    for (map<char, int>::const_iterator it = nodes[node].children.begin(); it != nodes[node].children.end(); ++it) {
+        word.push_back(it->first);
+        CollectFrom(it->second, word, matches);
+        word.pop_back();
+    }
+}
+
+void CompletionTrie::Collect(const string &prefix, vector<string> &matches) const {
+    int node = 0;
+    for (size_t i = 0; i < prefix.size(); i++) {
+        map<char, int>::const_iterator child = nodes[node].children.find(prefix[i]);
+        if (child == nodes[node].children.end()) {
+            return;
+        }
+        node = child->second;
+    }
+    string word = prefix;
+    CollectFrom(node, word, matches);
+}
+
+CompletionIndex::CompletionIndex() : inotify_fd(FAIL) {
+    for (const char *command : smash_commands) {
+        commands.Insert(command);
+    }
+    static constexpr const char* keywords[] = {"if", "while", "for"};
+    for (const char *keyword : keywords) {
+        commands.Insert(keyword);
+    }
+}
+
+CompletionIndex::~CompletionIndex() {
+    if (inotify_fd != FAIL) {
+        close(inotify_fd);
+    }
+}
+
+int CompletionIndex::Watch(const string &dir) {
+    if (inotify_fd == FAIL) {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd == FAIL) {
+            return FAIL;
+        }
+    }
+    int wd = inotify_add_watch(inotify_fd, dir.c_str(), IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                                        IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    if (wd != FAIL && watches.find(wd) == watches.end()) {
+        watches[wd].path = dir;
+    }
+    return wd;
+}
+
+void CompletionIndex::Unwatch(int wd) {
+    map<int, WatchedDir>::iterator it = watches.find(wd);
+    if (it == watches.end()) {
+        return;
+    }
+    for (set<string>::iterator name = it->second.executables.begin(); name != it->second.executables.end(); ++name) {
+        commands.Remove(*name);
+    }
+    inotify_rm_watch(inotify_fd, wd);
+    watches.erase(it);
+}
+
+void CompletionIndex::UpdateEntry(WatchedDir &dir, const string &name, bool exists, bool is_dir) {
+    string path = JoinPath(dir.path, name);
+    struct stat info;
+    bool executable = exists && !is_dir && stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode) &&
+                      access(path.c_str(), X_OK) == 0;
+    if (executable && dir.executables.insert(name).second) {
+        commands.Insert(name);
+    }
+    if (!executable && dir.executables.erase(name) > 0) {
+        commands.Remove(name);
+    }
+}
+
+void CompletionIndex::ScanDir(WatchedDir &dir) {
+    DIR *stream = opendir(dir.path.c_str());
+    if (stream == nullptr) {
+        return;
+    }
+    for (struct dirent *entry = readdir(stream); entry != nullptr; entry = readdir(stream)) {
+        string name = entry->d_name;
+        if (name == "." || name == "..") {
+            continue;
+        }
+        bool is_dir = (entry->d_type == DT_DIR);
+        struct stat info;
+        if ((entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) &&
+            stat(JoinPath(dir.path, name).c_str(), &info) == 0) {
+            is_dir = S_ISDIR(info.st_mode);
+        }
+        UpdateEntry(dir, name, true, is_dir);
+    }
+    closedir(stream);
+}
+
+void CompletionIndex::RefreshPath() {
+    const char *path = getenv("PATH");
+    string value = (path != nullptr) ? path : "";
+    if (value == path_value && inotify_fd != FAIL) {
+        return;
+    }
+    path_value = value;
+    while (!watches.empty()) {
+        Unwatch(watches.begin()->first);
+    }
+    stringstream dirs(value);
+    for (string dir; getline(dirs, dir, ':');) {
+        int wd = Watch(dir.empty() ? "." : dir); // a repeated directory gets its existing watch back
+        if (wd != FAIL) {
+            ScanDir(watches[wd]);
+        }
+    }
+}
+
+void CompletionIndex::ReadEvents() {
+    if (inotify_fd == FAIL) {
+        return;
+    }
+    char events[READBLOCK] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (true) {
+        ssize_t size = read(inotify_fd, events, sizeof(events));
+        if (size <= 0) {
+            return;
+        }
+        for (char *ptr = events; ptr < events + size; ptr += sizeof(struct inotify_event) + ((struct inotify_event *) ptr)->len) {
+            struct inotify_event *event = (struct inotify_event *) ptr;
+            if (event->mask & IN_Q_OVERFLOW) { // events were lost, start over
+                while (!watches.empty()) {
+                    Unwatch(watches.begin()->first);
+                }
+                path_value.clear();
+                RefreshPath();
+                return;
+            }
+            map<int, WatchedDir>::iterator it = watches.find(event->wd);
+            if (it == watches.end()) {
+                continue;
+            }
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                Unwatch(event->wd);
+                continue;
+            }
+            if (event->len == 0) {
+                continue;
+            }
+            bool exists = (event->mask & (IN_CREATE | IN_MOVED_TO | IN_ATTRIB)) != 0;
+            UpdateEntry(it->second, event->name, exists, (event->mask & IN_ISDIR) != 0);
+        }
+    }
+}
+
+// matches for the word under the cursor, commands in command position and directory entries otherwise
+void CompletionIndex::Complete(const string &word, bool is_command, vector<string> &matches) {
+    RefreshPath();
+    ReadEvents();
+    size_t slash = word.rfind('/');
+    if (is_command && slash == FIND_FAIL) {
+        commands.Collect(word, matches);
+        sort(matches.begin(), matches.end());
+        matches.erase(unique(matches.begin(), matches.end()), matches.end());
+        return;
+    }
+    string dir_part = (slash == FIND_FAIL) ? "" : word.substr(0, slash + 1);
+    string base = (slash == FIND_FAIL) ? word : word.substr(slash + 1);
+    // listings come from the same inotify-backed cache that ls and globbing use
+    const vector<DirEntry> *entries = GlobalSmash().GetDirectoryState()->List(dir_part.empty() ? "." : dir_part);
+    if (entries == nullptr) {
+        return;
+    }
+    for (size_t i = 0; i < entries->size(); i++) {
+        const DirEntry &entry = (*entries)[i];
+        if (entry.name.compare(0, base.size(), base) == 0 && (entry.name[0] != '.' || (!base.empty() && base[0] == '.'))) {
+            matches.push_back(dir_part + entry.name + (entry.is_dir ? "/" : ""));
+        }
+    }
+}
+
+void LineEditor::AddHistory(const string &line) {
+    if (_trim(line).empty() || (!history.empty() && history.back() == line)) {
+        return;
+    }
+    history.push_back(line);
+    if (history.size() > HISTORY_MAX_RECORDS) {
+        history.erase(history.begin());
+    }
+}
+
+static bool WriteFully(int fd, const string &text) {
+    size_t written = 0;
+    while (written < text.size()) {
+        ssize_t count = write(fd, text.data() + written, text.size() - written);
+        if (count == FAIL && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        written += count;
+    }
+    return true;
+}
+
+static void WriteTerminal(const string &text) {
+    WriteFully(1, text);
+}
+
+// reads one byte from the terminal, FAIL on end of input and 0 when ctrl-C interrupted the wait.
+// Captured job output is drained while it waits.
+static int ReadKey(int timeout_ms = -1) {
+    // job output and EINTR wake poll early, the wait resumes with whatever is left until the deadline
+    long long deadline_ns = (timeout_ms < 0) ? FAIL : MonotonicNanos() + timeout_ms * (NANOS_PER_SECOND / 1000);
+    while (true) {
+        int wait_ms = -1;
+        if (deadline_ns != FAIL) {
+            long long left_ns = max(0LL, deadline_ns - MonotonicNanos());
+            wait_ms = (int) ((left_ns + NANOS_PER_SECOND / 1000 - 1) / (NANOS_PER_SECOND / 1000));
+        }
+        vector<struct pollfd> fds(1, pollfd{0, POLLIN, 0});
+        GlobalSmash().AddJobOutputFds(fds);
+        int ready = poll(fds.data(), fds.size(), wait_ms);
+        if (ready == FAIL && errno == EINTR) {
+            if (GlobalSmash().GetJobStateTable()->TakeInterrupt()) {
+                return 0;
+            }
+            continue;
+        }
+        if (ready <= 0) {
+            return (ready == 0) ? 0 : FAIL;
+        }
+        if (fds[0].revents == 0) {
+            GlobalSmash().ServiceJobOutputs();
+            continue;
+        }
+        unsigned char key;
+        ssize_t count = read(0, &key, 1);
+        return (count == 1) ? key : FAIL;
+    }
+}
+
+void LineEditor::Redraw(const string &prompt) {
+    string screen = "\r" + prompt + buffer + "\x1b[K";
+    if (cursor < buffer.size()) {
+        screen += "\x1b[" + to_string(buffer.size() - cursor) + "D";
+    }
+    WriteTerminal(screen);
+}
+
+void LineEditor::Insert(const string &text) {
+    buffer.insert(cursor, text);
+    cursor += text.size();
+}
+
+void LineEditor::ShowHistory(size_t index, string &draft, size_t &history_pos) {
+    if (history_pos == history.size()) {
+        draft = buffer;
+    }
+    history_pos = index;
+    buffer = (index == history.size()) ? draft : history[index];
+    cursor = buffer.size();
+}
+
+// ctrl-R, true when the found line should run right away
+bool LineEditor::SearchHistory(const string &prompt) {
+    string query;
+    string original = buffer;
+    size_t match = history.size();
+    while (true) {
+        string found = (match < history.size()) ? history[match] : "";
+        WriteTerminal("\r(reverse-i-search)`" + query + "': " + found + "\x1b[K");
+        int key = ReadKey();
+        if (key == FAIL || key == 0 || key == 7) { // ctrl-G or ctrl-C give up the search
+            buffer = original;
+            cursor = buffer.size();
+            Redraw(prompt);
+            return false;
+        }
+        if (key == '\r' || key == '\n') {
+            buffer = found.empty() ? original : found;
+            cursor = buffer.size();
+            return true;
+        }
+        size_t from = match;
+        if (key == 18) {
+            from = (match == 0) ? history.size() : match - 1;
+            if (match == history.size()) {
+                from = history.size() - 1;
+            }
+        }
+        else if (key == 127 || key == 8) {
+            if (!query.empty()) {
+                query.pop_back();
+            }
+            from = history.size() - 1;
+        }
+        else if (key >= 32 && key != 127) {
+            query.push_back((char) key);
+            from = (match < history.size()) ? match : history.size() - 1;
+        }
+        else { // any other key keeps the match for editing
+            if (key == 27) {
+                ReadKey(50);
+                ReadKey(50);
+            }
+            buffer = found.empty() ? original : found;
+            cursor = buffer.size();
+            Redraw(prompt);
+            return false;
+        }
+        match = history.size();
+        for (size_t i = from + 1; i-- > 0 && from < history.size();) {
+            if (history[i].find(query) != FIND_FAIL) {
+                match = i;
+                break;
+            }
+        }
+    }
+}
+
+void LineEditor::Complete(const string &prompt) {
+    size_t start = buffer.find_last_of(" \t", cursor == 0 ? 0 : cursor - 1);
+    start = (start == FIND_FAIL || cursor == 0) ? 0 : start + 1;
+    string before = _trim(buffer.substr(0, start));
+    bool is_command = before.empty() || before.back() == '|' || before.back() == ';' || before.back() == '&';
+    string word = buffer.substr(start, cursor - start);
+    vector<string> matches;
+    completion.Complete(word, is_command, matches);
+    if (matches.empty()) {
+        WriteTerminal("\a");
+        return;
+    }
+    string common = matches[0];
+    for (size_t i = 1; i < matches.size(); i++) {
+        size_t length = 0;
+        while (length < common.size() && length < matches[i].size() && common[length] == matches[i][length]) {
+            length++;
+        }
+        common.resize(length);
+    }
+    if (matches.size() == 1) {
+        Insert(common.substr(word.size()) + (common.back() == '/' ? "" : " "));
+        return;
+    }
+    if (common.size() > word.size()) {
+        Insert(common.substr(word.size()));
+        return;
+    }
+    string listing = "\n";
+    for (size_t i = 0; i < matches.size() && i < COMPLETION_MAX_LISTED; i++) {
+        listing += matches[i] + "  ";
+    }
+    WriteTerminal(listing + (matches.size() > COMPLETION_MAX_LISTED ? "...\n" : "\n"));
+    Redraw(prompt);
+}
+
+// edits one line in raw mode, false on end of input
+bool LineEditor::ReadLine(const string &prompt, string &line) {
+    cout.flush();
+    struct termios saved;
+    if (tcgetattr(0, &saved) == FAIL) {
+        return false;
+    }
+    struct termios raw = saved;
+    raw.c_lflag &= ~(ICANON | ECHO | IEXTEN); // ISIG stays, ctrl-C and ctrl-Z still reach smash
+    raw.c_iflag &= ~(IXON | ICRNL);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(0, TCSADRAIN, &raw);
+    buffer.clear();
+    cursor = 0;
+    string draft;
+    size_t history_pos = history.size();
+    bool done = false;
+    bool got_line = false;
+    Redraw(prompt);
+    while (!done) {
+        GlobalSmash().WaitForInput();
+        int key = ReadKey();
+        switch (key) {
+            case FAIL:
+                done = true;
+                break;
+            case 0: // ctrl-C, the handler already ended the line
+                buffer.clear();
+                cursor = 0;
+                history_pos = history.size();
+                break;
+            case '\r':
+            case '\n':
+                done = got_line = true;
+                break;
+            case 4: // ctrl-D
+                if (buffer.empty()) {
+                    done = true;
+                }
+                else if (cursor < buffer.size()) {
+                    buffer.erase(cursor, 1);
+                }
+                break;
+            case 127:
+            case 8:
+                if (cursor > 0) {
+                    buffer.erase(--cursor, 1);
+                }
+                break;
+            case 1:
+                cursor = 0;
+                break;
+            case 5:
+                cursor = buffer.size();
+                break;
+            case 2:
+                cursor = (cursor > 0) ? cursor - 1 : 0;
+                break;
+            case 6:
+                cursor = min(cursor + 1, buffer.size());
+                break;
+            case 11:
+                buffer.erase(cursor);
+                break;
+            case 21:
+                buffer.erase(0, cursor);
+                cursor = 0;
+                break;
+            case 23: {
+                size_t start = buffer.find_last_not_of(' ', cursor == 0 ? 0 : cursor - 1);
+                start = (start == FIND_FAIL || cursor == 0) ? 0 : buffer.find_last_of(' ', start);
+                start = (start == FIND_FAIL) ? 0 : start + 1;
+                buffer.erase(start, cursor - start);
+                cursor = start;
+                break;
+            }
+            case 12:
+                WriteTerminal("\x1b[H\x1b[2J");
+                break;
+            case 16:
+                if (history_pos > 0) {
+                    ShowHistory(history_pos - 1, draft, history_pos);
+                }
+                break;
+            case 14:
+                if (history_pos < history.size()) {
+                    ShowHistory(history_pos + 1, draft, history_pos);
+                }
+                break;
+            case 18:
+                if (SearchHistory(prompt)) {
+                    done = got_line = true;
+                }
+                break;
+            case '\t':
+                Complete(prompt);
+                break;
+            case 27: { // arrows, home, end and delete arrive as escape sequences
+                if (ReadKey(50) != '[') {
+                    break;
+                }
+                int code = ReadKey(50);
+                if (code == 'A' && history_pos > 0) {
+                    ShowHistory(history_pos - 1, draft, history_pos);
+                }
+                else if (code == 'B' && history_pos < history.size()) {
+                    ShowHistory(history_pos + 1, draft, history_pos);
+                }
+                else if (code == 'C') {
+                    cursor = min(cursor + 1, buffer.size());
+                }
+                else if (code == 'D') {
+                    cursor = (cursor > 0) ? cursor - 1 : 0;
+                }
+                else if (code == 'H') {
+                    cursor = 0;
+                }
+                else if (code == 'F') {
+                    cursor = buffer.size();
+                }
+                else if (code == '3' && ReadKey(50) == '~' && cursor < buffer.size()) {
+                    buffer.erase(cursor, 1);
+                }
+                break;
+            }
+            default:
+                if (key >= 32) {
+                    Insert(string(1, (char) key));
+                }
+        }
+        if (!done || got_line) {
+            Redraw(prompt);
+        }
+    }
+    WriteTerminal("\n");
+    tcsetattr(0, TCSADRAIN, &saved);
+    if (got_line) {
+        line = buffer;
+        AddHistory(line);
+    }
+    return got_line;
+}
+
+// TODO: Add your implementation for classes in Commands.h
+
+SmallShell::SmallShell() : prompt("smash"), last_dir(nullptr), fore_ground_job(nullptr) ,smash_pid(getpid()),
+cpu_policy(NoPolicy), next_rr_cpu(0), cgroup_root(""), cgroup_checked(false),
+pipe_size(0), job_control(false), last_status(0), environment(nullptr), here_doc_fd(FAIL), terminal_fd(FAIL),
+line_editor(nullptr), directory_state(nullptr), remote_server(nullptr) {
+    jobs_list = JobsList();
+    capture_saved_fds[0] = capture_saved_fds[1] = FAIL;
+}
+
+SmallShell::~SmallShell() {
+    if (last_dir != nullptr) {
+        delete[] last_dir;
+    }
+    if (!cgroup_root.empty() && IsSmashPid(getpid())) {
+        LeaveCgroup(cgroup_root);
+    }
+    if (IsSmashPid(getpid())) {
+        zygote.Stop();
+    }
+    delete remote_server;
+    delete directory_state;
+    delete line_editor;
+    delete environment;
+}
+
+Command * SmallShell::CreateCommand(const char *cmd_line, bool is_special, bool is_piped, bool is_timeout) {
+    char* cmd = new char[strlen(cmd_line) + 1];
+    strcpy(cmd, cmd_line);
+    string first_word = GetFirstStringInCmdLine(cmd_line);
+    if (first_word.compare("") == 0) {
+        return nullptr;
+    }
+    if (!is_special && IsInputRedirectionCommand(cmd_line)) {
+        return new InputRedirectionCommand(cmd);
+    }
+    if (!is_special && IsRedirectionCommand(cmd_line)) {
+        return new RedirectionCommand(cmd);
+    }
+    if (IsPipeCommand(cmd_line)) {
+        return new PipeCommand(cmd);
+    }
+    return CreateNamedCommand(first_word, cmd, is_piped, is_timeout);
+}
+
+Command *SmallShell::CreateNamedCommand(const string &first_word, char *cmd, bool is_piped, bool is_timeout) {
+    if (first_word.compare("chprompt") == 0) {
+        return new ChpromptCommand(cmd);
+    }
+    if  (first_word.compare("ls") == 0) {
+        return new LsCommand(cmd);
+    }
+    if (first_word.compare("showpid") == 0) {
+        return new ShowPidCommand(cmd);
+    }
+    if (first_word.compare("pwd") == 0) {
+        return new GetCurrDirCommand(cmd);
+    }
+    if (first_word.compare("cd") == 0) {
+        return new ChangeDirCommand(cmd);
+    }
+    if (first_word.compare("jobs") == 0) {
+        return new JobsCommand(cmd);
+    }
+    if (first_word.compare("kill") == 0) {
+        return new KillCommand(cmd);
+    }
+    if (first_word.compare("export") == 0) {
+        return new ExportCommand(cmd);
+    }
+    if (first_word.compare("unset") == 0) {
+        return new UnsetCommand(cmd);
+    }
+    if (first_word.compare("wait") == 0) {
+        return new WaitCommand(cmd);
+    }
+    if (first_word.compare("fg") == 0) {
+        return new ForegroundCommand(cmd);
+    }
+    if (first_word.compare("bg") == 0) {
+        return new BackgroundCommand(cmd);
+    }
+    if (first_word.compare("cp") == 0){
+        return new CopyCommand(cmd);
+    }
+    if (first_word.compare("quit") == 0) {
+        return new QuitCommand(cmd);
+    }
+    if (first_word.compare("cpupolicy") == 0) {
+        return new CpuPolicyCommand(cmd);
+    }
+    if (first_word.compare("pipesize") == 0) {
+        return new PipeSizeCommand(cmd);
+    }
+    if (first_word.compare("passthru") == 0) {
+        return new PassthruCommand(cmd);
+    }
+    if (first_word.compare("coproc") == 0) {
+        return new CoprocCommand(cmd);
+    }
+    if (first_word.compare("send") == 0) {
+        return new SendCommand(cmd);
+    }
+    if (first_word.compare("recv") == 0) {
+        return new RecvCommand(cmd);
+    }
+    if (!is_timeout && first_word.compare("timeout") == 0) {
+        return new TimeoutCommand(cmd);
+    }
+    if (first_word.compare("cpuset") == 0) {
+        return new CpusetCommand(cmd, is_piped, is_timeout);
+    }
+    if (first_word.compare("numa") == 0) {
+        return new NumaCommand(cmd, is_piped, is_timeout);
+    }
+    if (first_word.compare("limit") == 0) {
+        return new LimitCommand(cmd, is_piped, is_timeout);
+    }
+    return new ExternalCommand(cmd, is_piped);
+}
+
+// a compiled command line hands its expanded words to the command created next
+static const vector<string>* prepared_args = nullptr;
+
+static char *CopyCmdLine(const string &cmd_line) {
+    char* cmd = new char[cmd_line.size() + 1];
+    strcpy(cmd, cmd_line.c_str());
+    return cmd;
+}
+
+// expands the stored words and creates the command, nullptr when the expansion failed
+Command *SmallShell::CreateCompiled(const CompiledCommand &compiled, bool is_piped) {
+    if (compiled.kind == CompiledCommand::Text) {
+        return CreateCommand(compiled.line.c_str(), compiled.is_special, is_piped, false);
+    }
+    vector<string> words;
+    if (compiled.kind == CompiledCommand::Simple) {
+        ExpandLexed(compiled.words, words);
+    }
+    else if (compiled.kind == CompiledCommand::Shell && !ShellWords(compiled.source, words)) {
+        return nullptr;
+    }
+    prepared_args = &words;
+    Command* cmd = nullptr;
+    if (compiled.kind == CompiledCommand::InputRedirect) {
+        cmd = new InputRedirectionCommand(CopyCmdLine(compiled.line), &compiled);
+    }
+    else if (compiled.kind == CompiledCommand::Redirect) {
+        cmd = new RedirectionCommand(CopyCmdLine(compiled.line), &compiled);
+    }
+    else if (compiled.kind == CompiledCommand::Pipe) {
+        cmd = new PipeCommand(CopyCmdLine(compiled.line), &compiled);
+    }
+    else {
+        cmd = CreateNamedCommand(compiled.name, CopyCmdLine(compiled.line), is_piped, false);
+    }
+    prepared_args = nullptr;
+    return cmd;
+}
+
+void SmallShell::RunCompiled(const CompiledCommand &compiled, bool is_piped) {
+    Command* cmd = CreateCompiled(compiled, is_piped);
+    if (cmd == nullptr && compiled.kind != CompiledCommand::Text) {
+        last_status = 1;
+    }
+    else if (cmd != nullptr && cmd->ExpansionFailed()) {
+        last_status = 1;
+        delete cmd;
+    }
+    else if (cmd != nullptr) {
+        last_status = 0; // commands that wait for a child overwrite it
+        cmd->execute();
+    }
+}
+
+void SmallShell::ExecuteCommand(const char* cmd_line, bool is_special, bool is_piped, bool is_timeout) {
+    Command* cmd = CreateCommand(cmd_line, is_special, is_piped, is_timeout);
+    if(cmd != nullptr && cmd->ExpansionFailed()) {
+        last_status = 1;
+        delete cmd;
+    }
+    else if(cmd != nullptr) {
+        last_status = 0; // commands that wait for a child overwrite it
+        cmd->execute();
+    }
+    else {
+        // Do something later
+    }
+}
+
+// reads fd to its end, growing the buffer in place; returns the number of bytes read
+static size_t ReadToEnd(int fd, vector<char> &buffer, off_t offset = 0) {
+    size_t size = 0;
+    while (true) {
+        if (size == buffer.size()) {
+            buffer.resize(max(buffer.size() * 2, (size_t) CAPTURE_INITIAL_SIZE));
+        }
+        ssize_t count = (offset >= 0) ? pread(fd, buffer.data() + size, buffer.size() - size, offset + size)
+                                      : read(fd, buffer.data() + size, buffer.size() - size);
+        if (count == FAIL && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return size;
+        }
+        size += count;
+    }
+}
+
+// runs cmd_line with its stdout in buffer, pure output builtins run in-process through a memfd
+size_t SmallShell::CaptureOutput(const string &cmd_line, vector<char> &buffer) {
+    cout.flush();
+    if (IsInProcessBuiltIn(cmd_line) && !IsRedirectionCommand(cmd_line.c_str()) &&
+        !IsPipeCommand(cmd_line.c_str())) {
+        int mem = memfd_create("smash-capture", MFD_CLOEXEC);
+        int saved_stdout = dup(1);
+        if (mem != FAIL && saved_stdout != FAIL) {
+            dup2(mem, 1);
+            ExecuteCommand(cmd_line.c_str());
+            cout.flush();
+            dup2(saved_stdout, 1);
+            close(saved_stdout);
+            size_t size = ReadToEnd(mem, buffer);
+            close(mem);
+            return size;
+        }
+        if (mem != FAIL) {
+            close(mem);
+        }
+        if (saved_stdout != FAIL) {
+            close(saved_stdout);
+        }
+    }
+    int fd[2];
+    if (pipe2(fd, O_CLOEXEC) == FAIL) {
+        perror("smash error: pipe failed");
+        return 0;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTSTP, SIG_IGN); // nobody would resume it while smash reads its output
+        dup2(fd[1], 1);
+        ExecuteCommand(cmd_line.c_str(), false, true);
+        exit(last_status);
+    }
+    close(fd[1]);
+    size_t size = 0;
+    if (pid == FAIL) {
+        perror("smash error: fork failed");
+    }
+    else {
+        size = ReadToEnd(fd[0], buffer, FAIL);
+        int status = 0;
+        if (waitpid(pid, &status, 0) == FAIL) {
+            perror("smash error: waitpid failed");
+        }
+        else {
+            last_status = StatusFromWait(status);
+        }
+    }
+    close(fd[0]);
+    return size;
+}
+
+// collects the words of one command line while it is expanded
+class WordSplitter {
+    string word;
+    bool has_word; // a quoted empty string is still a word
+    bool magic; // the word has an unquoted * ? or [ to glob
+public:
+    vector<string> words;
+    vector<bool> globs;
+    WordSplitter() : has_word(false), magic(false) {}
+    bool IsEmpty() const {
+        return !has_word;
+    }
+    void Open() {
+        has_word = true;
+    }
+    void Add(char c, bool is_magic = false) {
+        word.push_back(c);
+        has_word = true;
+        magic = magic || is_magic;
+    }
+    void AddQuoted(const string &value) {
+        word += value;
+        has_word = true;
+    }
+    // an unquoted expansion is split on whitespace, its pieces are never parsed again
+    void AddSplit(const string &value) {
+        for (size_t i = 0; i < value.size(); i++) {
+            if (isspace((unsigned char) value[i])) {
+                Finish();
+            }
+            else {
+                Add(value[i], strchr("*?[", value[i]) != nullptr);
+            }
+        }
+    }
+    // export NAME=$VALUE keeps the value in one word, like bash does for assignments
+    bool IsAssignment() const {
+        size_t equal = word.find('=');
+        return !words.empty() && words[0] == "export" && equal != FIND_FAIL &&
+               Environment::IsValidName(word.substr(0, equal));
+    }
+    void AddExpansion(const string &value, bool quoted) {
+        if (quoted || IsAssignment()) {
+            AddQuoted(value);
+        }
+        else {
+            AddSplit(value);
+        }
+    }
+    void Finish() {
+        if (has_word) {
+            words.push_back(word);
+            globs.push_back(magic);
+        }
+        word.clear();
+        has_word = false;
+        magic = false;
+    }
+};
+
+// splits line into words, then removes quotes and expands variables, $(...), ~ and globs from first_glob on, each once
+bool SmallShell::ExpandWords(const string &line, vector<string> &words, size_t first_glob) {
+    vector<LexedWord> lexed;
+    string error;
+    if (!LexWords(line, lexed, &error)) {
+        cout << "smash error: syntax error: " << error << endl;
+        return false;
+    }
+    ExpandLexed(lexed, words, first_glob);
+    return true;
+}
+
+// expands the words LexWords split, the same lexed words may be expanded again on every run
+void SmallShell::ExpandLexed(const vector<LexedWord> &lexed, vector<string> &words, size_t first_glob) {
+    WordSplitter splitter;
+    string value;
+    vector<char> buffer;
+    for (size_t i = 0; i < lexed.size(); i++) {
+        for (size_t j = 0; j < lexed[i].size(); j++) {
+            const WordPart &part = lexed[i][j];
+            if (part.kind == WordPart::Literal && part.quoted) {
+                splitter.AddQuoted(part.text);
+            }
+            else if (part.kind == WordPart::Literal) {
+                for (size_t k = 0; k < part.text.size(); k++) {
+                    splitter.Add(part.text[k], strchr("*?[", part.text[k]) != nullptr);
+                }
+            }
+            else if (part.kind == WordPart::Variable) {
+                value.clear();
+                if (part.text == "?") {
+                    value = to_string(last_status);
+                }
+                else {
+                    GetEnvironment()->Get(part.text, &value);
+                }
+                splitter.AddExpansion(value, part.quoted);
+            }
+            else if (part.kind == WordPart::Substitution) {
+                size_t size = CaptureOutput(part.text, buffer);
+                while (size > 0 && buffer[size - 1] == '\n') {
+                    size--;
+                }
+                value.assign(buffer.data(), size);
+                splitter.AddExpansion(value, part.quoted);
+            }
+            else if (splitter.IsEmpty() && GetEnvironment()->Get("HOME", &value)) {
+                splitter.AddQuoted(value);
+            }
+            else {
+                splitter.Add('~');
+            }
+        }
+        splitter.Finish();
+    }
+    for (size_t i = 0; i < splitter.words.size(); i++) {
+        if (i < first_glob || !splitter.globs[i]) {
+            words.push_back(splitter.words[i]);
+            continue;
+        }
+        vector<string> expanded = glob_expander.Expand(splitter.words[i]);
+        words.insert(words.end(), expanded.begin(), expanded.end());
+    }
+}
+
+// replaces each $(...) outside single quotes with ${N} and runs it, its output becomes positional parameter N
+bool SmallShell::SubstituteParameters(const string &line, string &script, vector<string> &outputs) {
+    vector<char> buffer;
+    char quote = 0;
+    for (size_t i = 0; i < line.size(); i++) {
+        char c = line[i];
+        if (c == '\\' && quote != '\'' && i + 1 < line.size()) {
+            script.push_back(c);
+            script.push_back(line[++i]);
+            continue;
+        }
+        if ((c == '\'' || c == '"') && (quote == 0 || quote == c)) {
+            quote = (quote == 0) ? c : 0;
+        }
+        if (c != '$' || quote == '\'' || i + 2 >= line.size() || line[i + 1] != '(' || line[i + 2] == '(') {
+            script.push_back(c);
+            continue;
+        }
+        size_t end = FindSubstitutionEnd(line, i);
+        if (end == FIND_FAIL) {
+            cout << "smash error: syntax error: unterminated $(" << endl;
+            return false;
+        }
+        size_t size = CaptureOutput(line.substr(i + 2, end - i - 2), buffer);
+        while (size > 0 && buffer[size - 1] == '\n') {
+            size--;
+        }
+        outputs.push_back(string(buffer.data(), size));
+        script += "${" + to_string(outputs.size()) + "}";
+        i = end;
+    }
+    return true;
+}
+
+// a redirection target must expand to exactly one file name
+bool SmallShell::ExpandRedirectTarget(string &file_name) {
+    vector<LexedWord> target;
+    string error;
+    if (!LexWords(file_name, target, &error)) {
+        cout << "smash error: syntax error: " << error << endl;
+        return false;
+    }
+    return ExpandRedirectTarget(target, file_name);
+}
+
+// file_name holds the target as written until it is expanded
+bool SmallShell::ExpandRedirectTarget(const vector<LexedWord> &target, string &file_name) {
+    vector<string> words;
+    ExpandLexed(target, words, 0);
+    if (words.size() != 1) {
+        cout << "smash error: " << file_name << ": ambiguous redirect" << endl;
+        return false;
+    }
+    file_name = words[0];
+    return true;
+}
+
+void SmallShell::ExecuteLine(const string &line) {
+    if (here_doc.IsOpen()) {
+        if (here_doc.AddLine(line)) {
+            string cmd_line = here_doc.GetCmdLine();
+            here_doc_fd = here_doc.Seal(*GetEnvironment(), last_status);
+            if (here_doc_fd != FAIL) {
+                ExecuteCommand(cmd_line.c_str());
+            }
+            if (here_doc_fd != FAIL) { // the command never took it
+                close(here_doc_fd);
+                here_doc_fd = FAIL;
+            }
+        }
+        return;
+    }
+    if (!script_compiler.IsOpen() && here_doc.Start(line)) {
+        return;
+    }
+    if (!script_compiler.Feed(line)) {
+        ExecuteCommand(line.c_str());
+    }
+}
+
+int SmallShell::TakeHereDocFd() {
+    int fd = here_doc_fd;
+    here_doc_fd = FAIL;
+    return fd;
+}
+
+bool SmallShell::IsScriptOpen() {
+    return script_compiler.IsOpen() || here_doc.IsOpen();
+}
+
+string SmallShell::GetPrompt() {
+    if (IsScriptOpen()) { // continuation of an if/while/for block or a here-document
+        return ">";
+    }
+    return (prompt + ">");
+}
+
+char *SmallShell::GetLastDir() {
+    return last_dir;
+}
+
+JobsList *SmallShell::GetJobsList() {
+    return &jobs_list;
+}
+
+JobStateTable *SmallShell::GetJobStateTable() {
+    return &job_table;
+}
+
+JobsList::JobEntry *SmallShell::GetForeGroundJob() {
+    return fore_ground_job;
+}
+
+void SmallShell::SetPrompt(string new_prom) {
+    prompt = new_prom;
+}
+
+void SmallShell::SetForeGroundJob(JobsList::JobEntry *job) {
+    fore_ground_job = job;
+    job_table.SetForeground(job != nullptr ? job->GetJobPid() : 0);
+    if (job != nullptr && job->GetJobId() == FAIL) { // new jobs start here, fg and bg report theirs as continued
+        jobs_list.EmitEvent("started", job);
+    }
+}
+
+void SmallShell::AddPendingPlacement(const JobPlacement &placement) {
+    pending_placement.Merge(placement);
+}
+
+void SmallShell::ClearPendingPlacement() {
+    pending_placement = JobPlacement();
+}
+
+bool SmallShell::HasPendingCpus() {
+    return pending_placement.HasCpus();
+}
+
+JobPlacement SmallShell::TakePlacement(bool is_background) {
+    JobPlacement placement = pending_placement;
+    pending_placement = JobPlacement();
+    if (!placement.IsEmpty() || !is_background || cpu_policy != RoundRobin || !IsSmashPid(getpid())) {
+        return placement;
+    }
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) {
+        return placement;
+    }
+    for (int i = 0; i < CPU_SETSIZE; i++) {
+        int cpu = (next_rr_cpu + i) % CPU_SETSIZE;
+        if (CPU_ISSET(cpu, &allowed)) {
+            cpu_set_t chosen;
+            CPU_ZERO(&chosen);
+            CPU_SET(cpu, &chosen);
+            placement.SetCpus(chosen);
+            next_rr_cpu = cpu + 1;
+            break;
+        }
+    }
+    return placement;
+}
+
+void SmallShell::AddPendingLimits(const JobLimits &limits) {
+    pending_limits.Merge(limits);
+}
+
+void SmallShell::ClearPendingLimits() {
+    pending_limits = JobLimits();
+}
+
+JobLimits SmallShell::TakeLimits() {
+    JobLimits limits = pending_limits;
+    pending_limits = JobLimits();
+    limits.Prepare();
+    return limits;
+}
+
+string SmallShell::GetCgroupRoot() {
+    if (cgroup_checked) {
+        return cgroup_root;
+    }
+    cgroup_checked = true;
+    string mount_point = "";
+    ifstream mount_info("/proc/self/mountinfo");
+    for (string line; getline(mount_info, line);) {
+        size_t separator = line.find(" - ");
+        if (separator == FIND_FAIL || line.compare(separator + 3, 8, "cgroup2 ") != 0) {
+            continue;
+        }
+        vector<string> fields;
+        ParseCommandLine(line.substr(0, separator), fields);
+        if (fields.size() > 4) {
+            mount_point = fields[4];
+            break;
+        }
+    }
+    string own_group = "";
+    ifstream self_cgroup("/proc/self/cgroup");
+    for (string line; getline(self_cgroup, line);) {
+        if (line.compare(0, 3, "0::") == 0) {
+            own_group = _trim(line.substr(3));
+        }
+    }
+    if (mount_point.empty() || own_group.empty()) {
+        return cgroup_root;
+    }
+    string parent = mount_point + (own_group == "/" ? "" : own_group);
+    string root = parent + "/smash-" + to_string(smash_pid);
+    string shell = root + "/shell";
+    if ((mkdir(root.c_str(), 0755) != 0 && errno != EEXIST) || (mkdir(shell.c_str(), 0755) != 0 && errno != EEXIST)) {
+        perror("smash error: cgroup mkdir failed");
+        rmdir(root.c_str());
+        return cgroup_root;
+    }
+    // a cgroup holding processes cannot hand controllers to its children (EBUSY), so smash and its zygote
+    // move into the shell leaf first and the job leaves become its siblings
+    bool moved = WriteCgroupFile(shell + "/cgroup.procs", to_string(smash_pid)) &&
+                 (!zygote.IsRunning() || WriteCgroupFile(shell + "/cgroup.procs", to_string(zygote.GetPid())));
+    if (!moved) {
+        perror("smash error: cgroup.procs write failed");
+    }
+    else if (!WriteCgroupFile(parent + "/cgroup.subtree_control", CGROUP_CONTROLLERS) &&
+             ReadCgroupValue(root + "/cgroup.controllers").empty()) { // EBUSY if other processes share the parent
+        cout << "smash error: cgroup: no controllers are delegated to " << parent << endl;
+    }
+    else if (!WriteCgroupFile(root + "/cgroup.subtree_control", CGROUP_CONTROLLERS)) {
+        perror("smash error: cgroup.subtree_control write failed");
+    }
+    else {
+        cgroup_root = root;
+        return cgroup_root;
+    }
+    LeaveCgroup(root);
+    return cgroup_root;
+}
+
+// moves smash and its zygote back to the cgroup they started in and removes root
+void SmallShell::LeaveCgroup(const string &root) {
+    string home = root.substr(0, root.rfind('/'));
+    WriteCgroupFile(home + "/cgroup.procs", to_string(smash_pid));
+    if (zygote.IsRunning()) {
+        WriteCgroupFile(home + "/cgroup.procs", to_string(zygote.GetPid()));
+    }
+    rmdir((root + "/shell").c_str());
+    rmdir(root.c_str());
+}
+
+bool SmallShell::AddCoproc(const string &name, CoprocEntry *coproc) {
+    return coprocs.insert(make_pair(name, coproc)).second;
+}
+
+CoprocEntry *SmallShell::GetCoproc(const string &name) {
+    map<string, CoprocEntry*>::iterator it = coprocs.find(name);
+    return (it == coprocs.end()) ? nullptr : it->second;
+}
+
+void SmallShell::ServiceCoprocs() {
+    if (coprocs.empty()) {
+        return;
+    }
+    jobs_list.RemoveFinishedJobs();
+    for (map<string, CoprocEntry*>::iterator it = coprocs.begin(); it != coprocs.end();) {
+        it->second->Service();
+        if (it->second->IsFinished(&jobs_list)) {
+            delete it->second;
+            it = coprocs.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+// a captured job writes into a pipe instead of the terminal, the child inherits 1 and 2 from here
+int SmallShell::BeginOutputCapture() {
+    if (!job_control || !isatty(1)) { // redirections and scripts keep their output
+        return FAIL;
+    }
+    int capture_fds[2];
+    if (pipe2(capture_fds, O_CLOEXEC) == FAIL) {
+        perror("smash error: pipe failed");
+        return FAIL;
+    }
+    cout.flush();
+    for (int fd = 1; fd <= 2; fd++) {
+        capture_saved_fds[fd - 1] = isatty(fd) ? fcntl(fd, F_DUPFD_CLOEXEC, 3) : FAIL;
+        if (capture_saved_fds[fd - 1] != FAIL) {
+            dup2(capture_fds[1], fd);
+        }
+    }
+    close(capture_fds[1]);
+    fcntl(capture_fds[0], F_SETFL, O_NONBLOCK);
+    return capture_fds[0];
+}
+
+void SmallShell::EndOutputCapture() {
+    for (int fd = 1; fd <= 2; fd++) {
+        if (capture_saved_fds[fd - 1] != FAIL) {
+            dup2(capture_saved_fds[fd - 1], fd);
+            close(capture_saved_fds[fd - 1]);
+            capture_saved_fds[fd - 1] = FAIL;
+        }
+    }
+}
+
+void SmallShell::AddJobOutput(int read_fd, int job_id, pid_t pid) {
+    JobOutput *stale = FindJobOutput(job_id); // a finished job that had this id
+    if (stale != nullptr) {
+        job_outputs.remove(stale);
+        delete stale;
+    }
+    job_outputs.push_back(new JobOutput(read_fd, job_id, pid));
+}
+
+// by pid when given, a job id alone also finds the output of a job that already finished
+JobOutput *SmallShell::FindJobOutput(int job_id, pid_t pid) {
+    for (list<JobOutput *>::iterator it = job_outputs.begin(); it != job_outputs.end(); ++it) {
+        if ((pid != FAIL) ? (*it)->GetPid() == pid : (*it)->GetJobId() == job_id) {
+            return *it;
+        }
+    }
+    return nullptr;
+}
+
+void SmallShell::AddJobOutputFds(vector<struct pollfd> &fds) const {
+    for (list<JobOutput *>::const_iterator it = job_outputs.begin(); it != job_outputs.end(); ++it) {
+        if ((*it)->GetPollFd() != FAIL) {
+            struct pollfd output = {(*it)->GetPollFd(), POLLIN, 0};
+            fds.push_back(output);
+        }
+    }
+}
+
+void SmallShell::ServiceJobOutputs() {
+    for (list<JobOutput *>::iterator it = job_outputs.begin(); it != job_outputs.end();) {
+        (*it)->Service();
+        if ((*it)->IsDone() && !jobs_list.JobPidExists((*it)->GetPid())) {
+            delete *it;
+            it = job_outputs.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+void SmallShell::WaitForInput() {
+    ServiceCoprocs();
+    RemoteServer *remote = (remote_server != nullptr && remote_server->IsRunning()) ? remote_server : nullptr;
+    if (remote != nullptr) {
+        remote->Service();
+    }
+    if ((coprocs.empty() || !isatty(0)) && remote == nullptr && job_event_fds.empty()) {
+        return; // buffered script input can't be polled on the fd
+    }
+    cout.flush();
+    while (cin.rdbuf()->in_avail() <= 0) {
+        vector<struct pollfd> fds;
+        struct pollfd std_in = {0, POLLIN, 0};
+        fds.push_back(std_in);
+        for (map<string, CoprocEntry*>::iterator it = coprocs.begin(); it != coprocs.end(); ++it) {
+            if (it->second->GetReadFd() != FAIL) {
+                struct pollfd coproc_out = {it->second->GetReadFd(), POLLIN, 0};
+                fds.push_back(coproc_out);
+            }
+            if (it->second->GetWriteFd() != FAIL) {
+                struct pollfd coproc_in = {it->second->GetWriteFd(), POLLOUT, 0};
+                fds.push_back(coproc_in);
+            }
+        }
+        if (remote != nullptr) {
+            remote->AddPollFds(fds);
+        }
+        AddJobOutputFds(fds);
+        if (poll(fds.data(), fds.size(), -1) == FAIL) {
+            if (errno != EINTR) {
+                perror("smash error: poll failed");
+                return;
+            }
+            jobs_list.RemoveFinishedJobs(); // SIGCHLD, followers hear about the exit right away
+        }
+        if (fds[0].revents != 0) {
+            return;
+        }
+        ServiceCoprocs();
+        if (remote != nullptr) {
+            remote->Service();
+        }
+        ServiceJobOutputs();
+    }
+}
+
+// stdin is done but remote clients may still drive smash, until one of them sends quit
+void SmallShell::ServeRemoteOnly() {
+    while (remote_server != nullptr && remote_server->IsRunning()) {
+        vector<struct pollfd> fds;
+        remote_server->AddPollFds(fds);
+        AddJobOutputFds(fds);
+        if (poll(fds.data(), fds.size(), -1) == FAIL) {
+            if (errno != EINTR) {
+                perror("smash error: poll failed");
+                return;
+            }
+            jobs_list.RemoveFinishedJobs();
+        }
+        ServiceCoprocs();
+        remote_server->Service();
+        ServiceJobOutputs();
+    }
+}
+
+RemoteServer::~RemoteServer() {
+    Stop();
+}
+
+bool RemoteServer::Start(const string &socket_path) {
+    if (socket_path.size() >= sizeof(((struct sockaddr_un *) nullptr)->sun_path)) {
+        cout << "smash error: remote: socket path too long" << endl;
+        return false;
+    }
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd == FAIL) {
+        perror("smash error: socket failed");
+        return false;
+    }
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path.c_str());
+    struct stat old_stat;
+    if (lstat(socket_path.c_str(), &old_stat) == 0) {
+        if (!S_ISSOCK(old_stat.st_mode)) { // never delete a file the path happens to name
+            cout << "smash error: remote: " << socket_path << " exists and is not a socket" << endl;
+            close(listen_fd);
+            listen_fd = FAIL;
+            return false;
+        }
+        unlink(socket_path.c_str()); // a stale socket from a smash that died
+    }
+    mode_t old_umask = umask(0177); // the socket file is created 0600, only its owner may connect
+    bool bound = bind(listen_fd, (struct sockaddr *) &address, sizeof(address)) != FAIL;
+    umask(old_umask);
+    if (!bound || listen(listen_fd, SOMAXCONN) == FAIL) {
+        perror("smash error: bind failed");
+        close(listen_fd);
+        listen_fd = FAIL;
+        return false;
+    }
+    path = socket_path;
+    owner = getpid();
+    return true;
+}
+
+void RemoteServer::Stop() {
+    for (size_t i = 0; i < clients.size(); i++) {
+        close(clients[i].fd);
+    }
+    clients.clear();
+    if (listen_fd != FAIL) {
+        close(listen_fd);
+        listen_fd = FAIL;
+        if (owner == getpid()) { // forked children share the object but not the socket file
+            unlink(path.c_str());
+        }
+    }
+}
+
+void RemoteServer::AddPollFds(vector<struct pollfd> &fds) const {
+    if (listen_fd == FAIL) {
+        return;
+    }
+    struct pollfd listener = {listen_fd, POLLIN, 0};
+    fds.push_back(listener);
+    for (size_t i = 0; i < clients.size(); i++) {
+        struct pollfd client = {clients[i].fd, (short) (clients[i].output.empty() ? POLLIN : POLLIN | POLLOUT), 0};
+        fds.push_back(client);
+    }
+}
+
+static void AppendFrame(string &out, char op, int32_t status, const char *data, size_t size) {
+    uint32_t length = htonl(1 + sizeof(status) + size);
+    int32_t net_status = htonl(status);
+    out.append((const char *) &length, sizeof(length));
+    out.push_back(op);
+    out.append((const char *) &net_status, sizeof(net_status));
+    out.append(data, size);
+}
+
+// runs one request with stdout and stderr captured, the response carries them back
+void RemoteServer::HandleFrame(Client &client, const string &frame) {
+    char op = frame.empty() ? 0 : frame[0];
+    string body = frame.empty() ? "" : frame.substr(1);
+    JobsList *jobs_list = GlobalSmash().GetJobsList();
+    if (op == 'J') {
+        ostringstream records;
+        jobs_list->PrintJobRecords(records);
+        AppendFrame(client.output, op, 0, records.str().data(), records.str().size());
+        return;
+    }
+    if (op == 'F') {
+        client.following = true;
+        AppendFrame(client.output, op, 0, "", 0);
+        return;
+    }
+    if (op == 'K') {
+        istringstream fields(body);
+        int job_id = 0, sig_num = 0;
+        if (!(fields >> job_id >> sig_num)) {
+            AppendFrame(client.output, op, EINVAL, "", 0);
+            return;
+        }
+        jobs_list->RemoveFinishedJobs();
+        if (!jobs_list->JobIdExists(job_id)) {
+            AppendFrame(client.output, op, ESRCH, "", 0);
+            return;
+        }
+        int status = (killpg(jobs_list->GetJobPidByJobId(job_id), sig_num) == 0) ? 0 : errno;
+        AppendFrame(client.output, op, status, "", 0);
+        return;
+    }
+    if (op != 'C' && op != 'W') {
+        AppendFrame(client.output, 'E', EINVAL, "unknown request", 15);
+        return;
+    }
+    string cmd_line = (op == 'W') ? "wait " + body : body;
+    if (GetFirstStringInCmdLine(cmd_line.c_str()) == "quit") { // smash exits inside it, answer the earlier requests first
+        Flush(client, true);
+    }
+    cout.flush();
+    int mem = memfd_create("smash-remote", MFD_CLOEXEC);
+    int saved_stdout = dup(1);
+    int saved_stderr = dup(2);
+    if (mem == FAIL || saved_stdout == FAIL || saved_stderr == FAIL) {
+        AppendFrame(client.output, op, errno, "capture failed", 14);
+        close(mem);
+        close(saved_stdout);
+        close(saved_stderr);
+        return;
+    }
+    dup2(mem, 1);
+    dup2(mem, 2);
+    GlobalSmash().ExecuteLine(cmd_line);
+    cout.flush();
+    dup2(saved_stdout, 1);
+    dup2(saved_stderr, 2);
+    close(saved_stdout);
+    close(saved_stderr);
+    vector<char> buffer;
+    size_t size = ReadToEnd(mem, buffer);
+    close(mem);
+    AppendFrame(client.output, op, GlobalSmash().GetLastStatus(), buffer.data(), size);
+}
+
+// accepts, reads whole frames and answers them in order, so a client may pipeline many requests
+void RemoteServer::Service() {
+    if (listen_fd == FAIL) {
+        return;
+    }
+    while (clients.size() < REMOTE_MAX_CLIENTS) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == FAIL) {
+            break;
+        }
+        struct ucred peer;
+        socklen_t peer_size = sizeof(peer);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &peer_size) == FAIL || peer.uid != geteuid()) {
+            close(fd); // the file mode is the first check, the peer's uid the second
+            continue;
+        }
+        Client client = {fd, "", "", false};
+        clients.push_back(client);
+    }
+    for (size_t i = 0; i < clients.size(); i++) {
+        bool closed = false;
+        char chunk[READBLOCK];
+        while (true) {
+            ssize_t count = read(clients[i].fd, chunk, sizeof(chunk));
+            if (count > 0) {
+                clients[i].input.append(chunk, count);
+                continue;
+            }
+            closed = (count == 0 || (errno != EAGAIN && errno != EINTR));
+            break;
+        }
+        size_t offset = 0;
+        while (clients[i].input.size() - offset >= sizeof(uint32_t)) {
+            uint32_t length;
+            memcpy(&length, clients[i].input.data() + offset, sizeof(length));
+            length = ntohl(length);
+            if (length > REMOTE_MAX_FRAME) {
+                closed = true;
+                break;
+            }
+            if (clients[i].input.size() - offset - sizeof(length) < length) {
+                break;
+            }
+            HandleFrame(clients[i], clients[i].input.substr(offset + sizeof(length), length));
+            offset += sizeof(length) + length;
+        }
+        clients[i].input.erase(0, offset);
+        closed = !Flush(clients[i], false) || closed;
+        if (closed && clients[i].output.empty()) {
+            close(clients[i].fd);
+            clients.erase(clients.begin() + i);
+            i--;
+        }
+    }
+}
+
+// sends what it can of the pending responses, false once the client is gone
+bool RemoteServer::Flush(Client &client, bool block) {
+    while (!client.output.empty()) {
+        if (block) {
+            struct pollfd writable = {client.fd, POLLOUT, 0};
+            poll(&writable, 1, -1);
+        }
+        ssize_t count = send(client.fd, client.output.data(), client.output.size(), MSG_NOSIGNAL);
+        if (count == FAIL && (errno == EAGAIN || errno == EINTR)) {
+            if (!block) {
+                return true;
+            }
+            continue;
+        }
+        if (count <= 0) {
+            client.output.clear();
+            return false;
+        }
+        client.output.erase(0, count);
+    }
+    return true;
+}
+
+bool RemoteServer::HasFollowers() const {
+    for (size_t i = 0; i < clients.size(); i++) {
+        if (clients[i].following) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void RemoteServer::Publish(const string &event) {
+    for (size_t i = 0; i < clients.size(); i++) {
+        if (clients[i].following) {
+            AppendFrame(clients[i].output, 'E', 0, event.data(), event.size());
+            Flush(clients[i], false); // the rest goes out from Service
+        }
+    }
+}
+
+// the client side, every request goes out before the first response is read
+int RemoteServer::RunClient(const string &socket_path, const vector<string> &requests) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+    if (fd == FAIL || connect(fd, (struct sockaddr *) &address, sizeof(address)) == FAIL) {
+        perror("smash error: connect failed");
+        return 1;
+    }
+    string out;
+    bool following = false;
+    for (size_t i = 0; i < requests.size(); i++) {
+        const string &request = requests[i];
+        char op = 'C';
+        string body = request;
+        following = following || request == ":follow";
+        if (request == ":jobs" || request == ":follow" || request.compare(0, 6, ":kill ") == 0 ||
+            request.compare(0, 5, ":wait") == 0) {
+            op = (char) toupper(request[1]);
+            body = _trim(request.substr(request.find_first_of(" ") == FIND_FAIL ? request.size() :
+                                        request.find_first_of(" ")));
+        }
+        uint32_t length = htonl(1 + body.size());
+        out.append((const char *) &length, sizeof(length));
+        out.push_back(op);
+        out += body;
+    }
+    for (size_t sent = 0; sent < out.size();) {
+        ssize_t count = send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+        if (count == FAIL) {
+            perror("smash error: send failed");
+            close(fd);
+            return 1;
+        }
+        sent += count;
+    }
+    int status = 0;
+    vector<char> input;
+    size_t size = 0;
+    for (size_t answered = 0; answered < requests.size() || following;) {
+        char chunk[READBLOCK];
+        ssize_t count = read(fd, chunk, sizeof(chunk));
+        if (count <= 0) {
+            break;
+        }
+        input.insert(input.begin() + size, chunk, chunk + count);
+        size += count;
+        size_t offset = 0;
+        while (size - offset >= sizeof(uint32_t) + 1 + sizeof(int32_t)) {
+            uint32_t length;
+            memcpy(&length, input.data() + offset, sizeof(length));
+            length = ntohl(length);
+            if (size - offset - sizeof(length) < length) {
+                break;
+            }
+            int32_t net_status;
+            memcpy(&net_status, input.data() + offset + sizeof(length) + 1, sizeof(net_status));
+            status = ntohl(net_status);
+            size_t header = sizeof(length) + 1 + sizeof(net_status);
+            cout.write(input.data() + offset + header, length - 1 - sizeof(net_status));
+            char op = input[offset + sizeof(length)];
+            if (op == 'K' && status != 0) {
+                cout << "smash error: kill: " << strerror(status) << endl;
+            }
+            if (op == 'E') { // job events don't answer a request
+                cout.flush();
+            }
+            else {
+                answered++;
+            }
+            offset += sizeof(length) + length;
+        }
+        input.erase(input.begin(), input.begin() + offset);
+        size -= offset;
+    }
+    cout.flush();
+    close(fd);
+    return status;
+}
+
+long long SmallShell::GetPipeSize() {
+    return pipe_size;
+}
+
+void SmallShell::SetPipeSize(long long size) {
+    pipe_size = size;
+}
+
+int SmallShell::GetLastStatus() {
+    return last_status;
+}
+
+void SmallShell::SetLastStatus(int status) {
+    last_status = status;
+}
+
+void SmallShell::FollowJobEvents(int fd) {
+    job_event_fds.push_back(fd);
+}
+
+void SmallShell::UnfollowJobEvents() {
+    for (size_t i = 0; i < job_event_fds.size(); i++) {
+        close(job_event_fds[i]);
+    }
+    job_event_fds.clear();
+}
+
+bool SmallShell::HasJobEventSubscribers() {
+    return !job_event_fds.empty() || (remote_server != nullptr && remote_server->HasFollowers());
+}
+
+void SmallShell::PublishJobEvent(const string &event) {
+    struct sigaction old_action;
+    IgnoreSigpipe(&old_action); // a follower that went away is dropped, not fatal
+    for (size_t i = 0; i < job_event_fds.size(); i++) {
+        if (write(job_event_fds[i], event.data(), event.size()) == FAIL && errno != EAGAIN) {
+            close(job_event_fds[i]);
+            job_event_fds.erase(job_event_fds.begin() + i);
+            i--;
+        }
+    }
+    RestoreSigpipe(&old_action);
+    if (remote_server != nullptr) {
+        remote_server->Publish(event);
+    }
+}
+
+RemoteServer *SmallShell::GetRemoteServer() {
+    if (remote_server == nullptr) {
+        remote_server = new RemoteServer();
+    }
+    return remote_server;
+}
+
+DirectoryState *SmallShell::GetDirectoryState() {
+    if (directory_state == nullptr) {
+        directory_state = new DirectoryState();
+    }
+    return directory_state;
+}
+
+LineEditor *SmallShell::GetLineEditor() {
+    if (line_editor == nullptr) {
+        line_editor = new LineEditor();
+    }
+    return line_editor;
+}
+
+Zygote *SmallShell::GetZygote() {
+    return &zygote;
+}
+
+Environment *SmallShell::GetEnvironment() {
+    if (environment == nullptr) {
+        environment = new Environment();
+    }
+    return environment;
+}
+
+GlobExpander *SmallShell::GetGlobExpander() {
+    return &glob_expander;
+}
+
+void SmallShell::EnableJobControl() {
+    job_control = isatty(0) && tcgetpgrp(0) == getpgrp();
+    if (job_control) { // fd 0 may be redirected while a job runs
+        terminal_fd = fcntl(0, F_DUPFD_CLOEXEC, 10);
+        job_control = (terminal_fd != FAIL);
+    }
+}
+
+bool SmallShell::HasJobControl() {
+    return job_control;
+}
+
+void SmallShell::GiveTerminalTo(pid_t pgid) {
+    if (!job_control) {
+        return;
+    }
+    sigset_t ttou, old_mask;
+    sigemptyset(&ttou);
+    sigaddset(&ttou, SIGTTOU);
+    sigprocmask(SIG_BLOCK, &ttou, &old_mask); // tcsetpgrp from a background group would stop us
+    if (tcsetpgrp(terminal_fd, pgid) != 0) {
+        perror("smash error: tcsetpgrp failed");
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+void SmallShell::ClaimTerminal() { // in a foreground child, so it never reads the terminal as a background job
+    if (!job_control) {
+        return;
+    }
+    setpgid(0, 0);
+    GiveTerminalTo(getpgrp());
+}
+
+void SmallShell::WaitForegroundJob(JobsList::JobEntry *job) {
+    pid_t pid = job->GetJobPid();
+    if (!job_control) { // the ctrl-C/ctrl-Z handlers only signal the job, the bookkeeping is done here
+        int status = 0;
+        struct rusage usage;
+        if (wait4(pid, &status, WUNTRACED, &usage) == FAIL) {
+            perror("smash error: waitpid failed");
+        }
+        else if (WIFSTOPPED(status)) {
+            jobs_list.AddJob(job, Stopped, job->GetJobId() == -1);
+            jobs_list.EmitEvent("stopped", job);
+            last_status = 128 + WSTOPSIG(status);
+        }
+        else {
+            last_status = StatusFromWait(status);
+            bool timed_out = job->IsTimeOut() && WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL;
+            jobs_list.EmitEvent(timed_out ? "timed-out" : "exited", job, last_status, &usage);
+        }
+        return;
+    }
+    GiveTerminalTo(pid);
+    // a captured job brought back with fg: its output goes to the terminal one ring at a time
+    JobOutput *output = FindJobOutput(job->GetJobId(), pid);
+    int stop_signal = 0;
+    bool interrupted = false;
+    bool killed = false; // the alarm handler kills timed out jobs with SIGKILL
+    struct rusage usage, leader_usage;
+    memset(&leader_usage, 0, sizeof(leader_usage));
+    while (true) {
+        siginfo_t info;
+        memset(&info, 0, sizeof(info));
+        if (output != nullptr) {
+            WriteTerminal(output->Take());
+        }
+        // the raw waitid also reports the resource usage of the reaped child
+        if (syscall(SYS_waitid, P_PGID, pid, &info, WEXITED | WSTOPPED | (output ? WNOHANG : 0), &usage) == FAIL) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != ECHILD) {
+                perror("smash error: waitid failed");
+            }
+            break;
+        }
+        if (info.si_pid == 0) { // nothing changed yet, SIGCHLD cuts the poll short
+            struct pollfd readable = {output->GetPollFd(), POLLIN, 0};
+            poll(&readable, 1, 100);
+            output->Service();
+            continue;
+        }
+        if (info.si_code == CLD_STOPPED) {
+            stop_signal = info.si_status;
+            last_status = 128 + stop_signal;
+            break;
+        }
+        if (info.si_pid == pid) {
+            last_status = (info.si_code == CLD_EXITED) ? info.si_status : 128 + info.si_status;
+            leader_usage = usage;
+            killed = (info.si_code == CLD_KILLED && info.si_status == SIGKILL);
+        }
+        if (info.si_pid == pid && (info.si_code == CLD_KILLED || info.si_code == CLD_DUMPED) &&
+            info.si_status == SIGINT) {
+            interrupted = true;
+        }
+    }
+    if (output != nullptr) {
+        output->Service();
+        WriteTerminal(output->Take());
+    }
+    GiveTerminalTo(getpgrp());
+    if (stop_signal != 0) {
+        if (stop_signal == SIGTSTP) {
+            cout << "smash: got ctrl-Z" << endl;
+        }
+        jobs_list.AddJob(job, Stopped, job->GetJobId() == -1);
+        jobs_list.EmitEvent("stopped", job);
+        cout << "smash: process " << pid << " was stopped" << endl;
+    }
+    else {
+        jobs_list.EmitEvent(job->IsTimeOut() && killed ? "timed-out" : "exited", job, last_status, &leader_usage);
+    }
+    if (interrupted) {
+        job_table.NoteInterrupt();
+        cout << "smash: got ctrl-C" << endl;
+        cout << "smash: process " << pid << " was killed" << endl;
+    }
+}
+
+CpuPolicy SmallShell::GetCpuPolicy() {
+    return cpu_policy;
+}
+
+void SmallShell::SetCpuPolicy(CpuPolicy policy) {
+    cpu_policy = policy;
+    next_rr_cpu = 0;
+}
+
+void SmallShell::UpdateLastDir(char *new_dir) {
+    if (last_dir == nullptr) {
+        last_dir = new_dir;
+    }
+    else {
+        delete[] last_dir;
+        last_dir = new_dir;
+    }
+}
+
+Command::Command(const char *cmd_line) : cmd_line(cmd_line), expansion_failed(false),
+args_expanded(prepared_args != nullptr) {
+    args = vector<string>();
+    if (args_expanded) {
+        args = *prepared_args;
+        num_of_args = args.size();
+        prepared_args = nullptr;
+    }
+    else {
+        num_of_args = ParseCommandLine(cmd_line, args);
+    }
+}
+
+Command::~Command() {
+    delete[] cmd_line;
+}
+
+BuiltInCommand::BuiltInCommand(const char *cmd_line) : Command(cmd_line), out(&cout) {
+    if (args_expanded) {
+        return;
+    }
+    vector<string> words;
+    if (!GlobalSmash().ExpandWords(RemoveBackgroundSign(string(cmd_line)), words)) {
+        expansion_failed = true;
+    }
+    else if (!words.empty()) {
+        args = words;
+        num_of_args = args.size();
+    }
+}
+
+ChpromptCommand::ChpromptCommand(const char *cmd_line) : BuiltInCommand(cmd_line), prompt("smash") {
+    if (num_of_args > 1) {
+        prompt = args.at(1);
+    }
+}
+
+void ChpromptCommand::execute() {
+    GlobalSmash().SetPrompt(this->prompt);
+}
+
+void LsCommand::execute() {
+    const vector<DirEntry> *entries = GlobalSmash().GetDirectoryState()->List(".");
+    if (entries == nullptr) {
+        return;
+    }
+    vector<string> names(1, ".");
+    names.push_back("..");
+    for (size_t i = 0; i < entries->size(); i++) {
+        names.push_back((*entries)[i].name);
+    }
+    sort(names.begin(), names.end(), [](const string &a, const string &b) {
+        return strcoll(a.c_str(), b.c_str()) < 0;
+    });
+    for (size_t i = 0; i < names.size(); i++) {
+        *out << names[i] << endl;
+    }
+}
+
+void ShowPidCommand::execute() {
+    *out << "smash pid is " << GlobalSmash().GetSmashPid() << endl;
+}
+
+void GetCurrDirCommand::execute() {
+    *out << GlobalSmash().GetDirectoryState()->GetCwd() << endl;
+}
+
+void ChangeDirCommand::AuxOfExe(string &str) {
+    string path = str;
+    if (str.compare("-") == 0) {
+        if (GlobalSmash().GetLastDir() == nullptr) {
+            cout << "smash error: cd: OLDPWD not set" << endl;
+            return;
+        }
+        path = GlobalSmash().GetLastDir();
+    }
+    DirectoryState *directory_state = GlobalSmash().GetDirectoryState();
+    string old_cwd = directory_state->GetCwd();
+    if (directory_state->ChangeDir(path)) {
+        char *last_dir = new char[old_cwd.length() + 1];
+        strcpy(last_dir, old_cwd.c_str());
+        GlobalSmash().UpdateLastDir(last_dir);
+    }
+}
+
+void ChangeDirCommand::execute() {
+    switch (num_of_args) {
+        case 1:
+            break;
+        case 2:
+            AuxOfExe(args.at(1));
+            break;
+        default:
+            cout << "smash error: cd: too many arguments" << endl;
+            break;
+    }
+}
+
+void JobsCommand::execute() {
+    JobsList *jobs_list = GlobalSmash().GetJobsList();
+    if (num_of_args > 1 && args.at(1) == "--json") {
+        jobs_list->PrintJobsJson(*out);
+        return;
+    }
+    if (num_of_args > 1 && args.at(1) == "--follow") { // events go to the current stdout, redirections included
+        int fd = fcntl(1, F_DUPFD_CLOEXEC, 3);
+        if (fd == FAIL) {
+            perror("smash error: fcntl failed");
+            return;
+        }
+        GlobalSmash().FollowJobEvents(fd);
+        return;
+    }
+    if (num_of_args > 1 && args.at(1) == "--unfollow") {
+        GlobalSmash().UnfollowJobEvents();
+        return;
+    }
+    if (num_of_args > 1 && args.at(1) == "-o") { // takes what the job wrote, which lets a blocked job go on
+        if (num_of_args != 3 || !IsStringNumber(args.at(2)) || args.at(2).size() > 9) {
+            cout << "smash error: jobs: invalid arguments" << endl;
+            return;
+        }
+        GlobalSmash().ServiceJobOutputs();
+        JobOutput *output = GlobalSmash().FindJobOutput(stoi(args.at(2)));
+        if (output == nullptr) {
+            cout << "smash error: jobs: job-id " << args.at(2) << " has no captured output" << endl;
+            return;
+        }
+        *out << output->Take();
+        out->flush();
+        GlobalSmash().ServiceJobOutputs();
+        return;
+    }
+    jobs_list->PrintJobsList(num_of_args > 1 && args.at(1) == "-v", *out);
+}
+
+void KillCommand::execute() {
+    if(num_of_args != 3) {
+        cout << "smash error: kill: invalid arguments" << endl;
+        return;
+    }
+    string sig = args.at(1);
+    if (sig[0] != '-' || !IsStringNumber(sig.erase(0,1)) || !IsStringNumber(args.at(2))) {
+        cout << "smash error: kill: invalid arguments" << endl;
+        return;
+    }
+    GlobalSmash().GetJobsList()->RemoveFinishedJobs();
+    int job_id = stoi(args.at(2));
+    int sig_num = stoi(sig);
+    if (!GlobalSmash().GetJobsList()->JobIdExists(job_id)) {
+        cout << "smash error: kill: job-id " << job_id << " does not exist" << endl;
+        return;
+    }
+    pid_t pid = GlobalSmash().GetJobsList()->GetJobPidByJobId(job_id);
+    if(killpg(pid, sig_num) != 0) {
+        perror("smash error: kill failed");
+    }
+    else {
+        cout << "signal number " << sig_num << " was sent to pid " << pid << endl;
+    }
+}
+
+void ExportCommand::execute() {
+    Environment *environment = GlobalSmash().GetEnvironment();
+    if (num_of_args == 1) {
+        environment->Print(*out);
+        return;
+    }
+    for (int i = 1; i < num_of_args; i++) {
+        size_t equal = args.at(i).find('=');
+        string name = args.at(i).substr(0, equal);
+        if (!Environment::IsValidName(name)) {
+            cout << "smash error: export: `" << args.at(i) << "': not a valid identifier" << endl;
+            continue;
+        }
+        if (equal == FIND_FAIL) { // every variable is already exported, only make sure it exists
+            string value;
+            if (!environment->Get(name, &value)) {
+                environment->Set(name, "");
+            }
+            continue;
+        }
+        environment->Set(name, args.at(i).substr(equal + 1));
+    }
+}
+
+void UnsetCommand::execute() {
+    for (int i = 1; i < num_of_args; i++) {
+        GlobalSmash().GetEnvironment()->Unset(args.at(i));
+    }
+}
+
+void WaitCommand::execute() {
+    JobsList *jobs_list = GlobalSmash().GetJobsList();
+    jobs_list->RemoveFinishedJobs();
+    bool wait_any = (num_of_args > 1 && args.at(1) == "-n");
+    if (wait_any && num_of_args > 2) {
+        cout << "smash error: wait: invalid arguments" << endl;
+        return;
+    }
+    vector<int> pending;
+    if (num_of_args == 1 || wait_any) {
+        pending = jobs_list->GetRunningJobIds();
+    }
+    for (int i = 1; i < num_of_args && !wait_any; i++) {
+        if (!IsStringNumber(args.at(i)) || args.at(i).size() > 9) {
+            cout << "smash error: wait: invalid arguments" << endl;
+            return;
+        }
+        pending.push_back(stoi(args.at(i)));
+    }
+    int status = (wait_any && pending.empty()) ? 127 : 0;
+    struct sigaction interruptible, old_action;
+    sigaction(SIGINT, NULL, &old_action);
+    interruptible = old_action;
+    interruptible.sa_flags &= ~SA_RESTART; // let ctrl-C break out of waitid
+    sigaction(SIGINT, &interruptible, NULL);
+    while (!pending.empty()) {
+        for (vector<int>::iterator it = pending.begin(); it != pending.end();) {
+            if (jobs_list->JobIdExists(*it)) {
+                ++it;
+                continue;
+            }
+            JobsList::JobEntry *finished = jobs_list->TakeFinishedJob(*it);
+            if (finished == nullptr) {
+                cout << "smash error: wait: job-id " << *it << " does not exist" << endl;
+                status = 127;
+            }
+            else {
+                status = finished->GetExitStatus();
+                delete finished;
+            }
+            it = pending.erase(it);
+            if (wait_any) { // the first finished job is enough
+                pending.clear();
+                break;
+            }
+        }
+        if (pending.empty()) {
+            break;
+        }
+        // one blocking wait for whichever child ends first, no polling
+        siginfo_t info;
+        memset(&info, 0, sizeof(info));
+        if (waitid(P_ALL, 0, &info, WEXITED | WNOWAIT) == FAIL) {
+            if (errno == EINTR) { // ctrl-C interrupts the wait, not the jobs
+                status = 128 + SIGINT;
+            }
+            else if (errno != ECHILD) {
+                perror("smash error: waitid failed");
+            }
+            break;
+        }
+        int wait_status = 0;
+        struct rusage usage;
+        if (wait4(info.si_pid, &wait_status, 0, &usage) == FAIL) {
+            perror("smash error: waitpid failed");
+            break;
+        }
+        jobs_list->MarkFinished(info.si_pid, wait_status, &usage);
+    }
+    sigaction(SIGINT, &old_action, NULL);
+    GlobalSmash().SetLastStatus(status);
+}
+
+void ForegroundCommand::execute() {
+    if (num_of_args != 1 && num_of_args != 2) {
+        cout << "smash error: fg: invalid arguments" << endl;
+        return;
+    }
+    int job_id_to_foreground = -1;
+
+    if(GlobalSmash().GetJobsList()->IsEmpty()) { // ***
+        cout << "smash error: fg: jobs list is empty" << endl;
+        return;
+    }
+    if(num_of_args == 1) {
+        job_id_to_foreground = GlobalSmash().GetJobsList()->GetMaxJobId(); // ***
+    }
+    if(num_of_args == 2) {
+        if(!IsStringNumber(args.at(1))) {
+            cout << "smash error: fg: invalid arguments" << endl;
+            return;
+        }
+        job_id_to_foreground = stoi(args.at(1));
+        if(!GlobalSmash().GetJobsList()->JobIdExists(job_id_to_foreground)) { // ***
+            cout << "smash error: fg: job-id " << job_id_to_foreground << " does not exist" << endl;
+            return;
+        }
+    }
+    JobsList::JobEntry *job_to_foreground = GlobalSmash().GetJobsList()->RemoveJobByJobId(job_id_to_foreground);
+    pid_t pid = job_to_foreground->GetJobPid();
+    GlobalSmash().GiveTerminalTo(pid);
+    if (killpg(pid, SIGCONT) != 0) {
+        perror("smash error: kill failed");
+        GlobalSmash().GiveTerminalTo(getpgrp());
+        return;
+    }
+    cout << job_to_foreground->GetCommand()->GetCmdLine() << " : " << pid << endl;
+    GlobalSmash().GetJobsList()->EmitEvent("continued", job_to_foreground);
+    GlobalSmash().SetForeGroundJob(job_to_foreground);
+    GlobalSmash().WaitForegroundJob(job_to_foreground);
+    if(!GlobalSmash().GetJobsList()->JobPidExists(pid)) { // ***
+        job_to_foreground->GetCommand()->GetLimits()->Release();
+        delete job_to_foreground;
+    }
+    GlobalSmash().SetForeGroundJob(nullptr);
+
+}
+
+void BackgroundCommand::execute() {
+    if (num_of_args != 1 && num_of_args != 2) {
+        cout << "smash error: bg: invalid arguments" << endl;
+        return;
+    }
+    int job_id_to_background = -1;
+    if(num_of_args == 1) {
+        job_id_to_background = GlobalSmash().GetJobsList()->GetMaxStoppedJobId(); // Return the Max id from the Stop jobs else 0
+        if(job_id_to_background == 0) {
+            cout << "smash error: bg: there is no stopped jobs to resume" << endl;
+            return;
+        }
+    }
+    if(num_of_args == 2) {
+        if(!IsStringNumber(args.at(1))) {
+            cout << "smash error: bg: invalid arguments" << endl;
+            return;
+        }
+        job_id_to_background = stoi(args.at(1));
+
+        if(!GlobalSmash().GetJobsList()->JobIdExists(job_id_to_background)) { // ***
+            cout << "smash error: bg: job-id " << job_id_to_background << " does not exist" << endl;
+            return;
+        }
+        JobsList::JobEntry *job_to_background = GlobalSmash().GetJobsList()->GetJobById(job_id_to_background); // ***
+        if(job_to_background->GetState() == Background) {
+            cout << "smash error: bg: job-id " << job_id_to_background << " is already running in the background" << endl;
+            return;
+        }
+    }
+    JobsList::JobEntry *job_to_background = GlobalSmash().GetJobsList()->GetJobById(job_id_to_background);
+    pid_t pid = job_to_background->GetJobPid();
+    cout << job_to_background->GetCommand()->GetCmdLine() << " : " << pid << endl;
+    if (killpg(pid, SIGCONT) != 0) {
+        perror("smash error: kill failed");
+        return;
+    }
+    job_to_background->SetState(Background);
+    GlobalSmash().GetJobsList()->EmitEvent("continued", job_to_background);
+}
+
+void QuitCommand::execute() {
+    if(num_of_args > 1 && args.at(1) == "kill") {
+        GlobalSmash().GetJobsList()->RemoveFinishedJobs();
+        cout << "smash: sending SIGKILL signal to " << GlobalSmash().GetJobsList()->GetSize() << " jobs:" << endl;
+        GlobalSmash().GetJobsList()->jobs_list.sort(JobsCmpSmallerId);
+        for (list<JobsList::JobEntry*>::iterator it = GlobalSmash().GetJobsList()->jobs_list.begin();
+        it != GlobalSmash().GetJobsList()->jobs_list.end(); it++) {
+            cout << (*it)->GetJobPid() << ": " << (*it)->GetCommand()->GetCmdLine() << endl;
+        }
+        GlobalSmash().GetJobsList()->KillAllJobs();
+    }
+    exit(0);
+}
+
+// lines with shell syntax go to bash unexpanded, it reads the variables from the environment as data
+static bool NeedsShell(const string &cmd_line) {
+    if (FindUnquoted(cmd_line, SHELL_SYNTAX_CHARS) != FIND_FAIL || cmd_line.find("$((") != FIND_FAIL) {
+        return true;
+    }
+    size_t start = cmd_line.find_first_not_of(WHITESPACE);
+    size_t end = FindUnquoted(cmd_line, WHITESPACE, start == FIND_FAIL ? cmd_line.size() : start);
+    return FindUnquoted(cmd_line.substr(0, end), "=", start == FIND_FAIL ? 0 : start) != FIND_FAIL;
+}
+
+// the line an external command runs, without its &, redirection and timeout prefix
+static string ExternalLine(const char *cmd_line) {
+    char* line = new char[strlen(cmd_line) + 1];
+    strcpy(line, cmd_line);
+    if(IsBackgroundCommand(line)) {
+        RemoveBackgroundSign(line);
+    }
+    if(IsRedirectionCommand(line)) {
+        RemoveRedirectionSign(line);
+    }
+    if(IsTimeoutCommand(line)) {
+        RemoveTimeoutSign(line);
+    }
+    string shell_line = line;
+    delete[] line;
+    return shell_line;
+}
+
+// bash gets the line as written, each $(...) output follows it as a positional parameter
+bool SmallShell::ShellWords(const string &shell_line, vector<string> &words) {
+    string script;
+    vector<string> outputs;
+    if (!SubstituteParameters(shell_line, script, outputs)) {
+        return false;
+    }
+    if (FindUnquoted(script, "$") != FIND_FAIL) { // bash -c starts with $? = 0
+        script = "(exit " + to_string(last_status) + "); " + script;
+    }
+    words = {"/bin/bash", "-c", script, "smash"};
+    words.insert(words.end(), outputs.begin(), outputs.end());
+    return true;
+}
+
+// expands before ExecuteCommand resets the status, so $? still holds the previous command's
+ExternalCommand::ExternalCommand(const char *cmd_line, bool isPiped) : Command(cmd_line), is_piped(isPiped) {
+    if (args_expanded) {
+        words = args;
+        return;
+    }
+    string shell_line = ExternalLine(cmd_line);
+    if (!NeedsShell(shell_line)) {
+        expansion_failed = !GlobalSmash().ExpandWords(shell_line, words);
+        return;
+    }
+    expansion_failed = !GlobalSmash().ShellWords(shell_line, words);
+}
+
+// splits line the way CreateCommand does and lexes the words, anything it cannot split ahead stays Text
+CompiledCommand *CompiledCommand::Compile(const string &line, bool is_special) {
+    string name = GetFirstStringInCmdLine(line.c_str());
+    CompiledCommand* compiled = nullptr;
+    string error;
+    if (name.empty()) {
+        return new CompiledCommand(Text, line, is_special);
+    }
+    if (!is_special && IsInputRedirectionCommand(line.c_str())) {
+        InputRedirectionCommand split(CopyCmdLine(line));
+        vector<string> words;
+        compiled = new CompiledCommand(InputRedirect, line);
+        compiled->source = split.GetFileName();
+        if (split.IsHereDoc() || ParseCommandLine(split.GetNewCmdLine(), words) == 0 || compiled->source.empty() ||
+            !LexWords(compiled->source, compiled->words, &error)) {
+            delete compiled;
+            return new CompiledCommand(Text, line, is_special);
+        }
+        compiled->first = Compile(split.GetNewCmdLine());
+        return compiled;
+    }
+    if (!is_special && IsRedirectionCommand(line.c_str())) {
+        RedirectionCommand split(CopyCmdLine(line));
+        compiled = new CompiledCommand(Redirect, line);
+        compiled->source = split.GetFileName();
+        compiled->sign = split.GetSign();
+        if (split.GetNewCmdLine().empty() || compiled->source.empty() ||
+            !LexWords(compiled->source, compiled->words, &error)) {
+            delete compiled;
+            return new CompiledCommand(Text, line, is_special);
+        }
+        // as RedirectionCommand::execute runs it
+        compiled->first = IsBuiltInCommand(split.GetNewCmdLine()) ? Compile(split.GetNewCmdLine(), true)
+                                                                  : Compile(line, true);
+        return compiled;
+    }
+    if (IsPipeCommand(line.c_str())) {
+        PipeCommand split(CopyCmdLine(line));
+        if (name == "pipesize" || split.GetFirst().empty() || split.GetSecond().empty()) {
+            return new CompiledCommand(Text, line, is_special);
+        }
+        compiled = new CompiledCommand(Pipe, line);
+        compiled->sign = split.GetSign();
+        compiled->background = split.IsBackground();
+        compiled->first = Compile(split.GetFirst());
+        compiled->second = Compile(split.GetSecond());
+        return compiled;
+    }
+    // these take their own text apart when they run
+    static constexpr const char* text_commands[] = {"timeout", "cpuset", "numa", "limit", "coproc", "send"};
+    if (find(begin(text_commands), end(text_commands), name) != end(text_commands)) {
+        return new CompiledCommand(Text, line, is_special);
+    }
+    string source = IsSmashCommand(name) ? RemoveBackgroundSign(line) : ExternalLine(line.c_str());
+    compiled = new CompiledCommand(Simple, line);
+    compiled->name = name;
+    if (!IsSmashCommand(name) && NeedsShell(source)) {
+        compiled->kind = Shell;
+        compiled->source = source;
+        return compiled;
+    }
+    if (!LexWords(source, compiled->words, &error)) { // the error is reported when the line runs
+        delete compiled;
+        return new CompiledCommand(Text, line, is_special);
+    }
+    return compiled;
+}
+
+void ExternalCommand::execute() {
+    bool is_cmd_background = IsBackgroundCommand(GetCmdLine());
+    bool is_cmd_timeout = IsTimeoutCommand(GetCmdLine());
+    if (words.empty()) { // only empty expansions, nothing to run
+        return;
+    }
+    char **envp = GlobalSmash().GetEnvironment()->GetEnvp();
+    placement = GlobalSmash().TakePlacement(is_cmd_background);
+    limits = GlobalSmash().TakeLimits();
+    pid_t pid = FAIL;
+    int capture_fd = (is_cmd_background && !is_piped) ? GlobalSmash().BeginOutputCapture() : FAIL;
+    if (!is_piped && placement.IsEmpty() && limits.IsEmpty() && GlobalSmash().IsSmashPid(getpid())) {
+        pid = GlobalSmash().GetZygote()->Launch(GetCmdLine(), words, envp,
+                                               !is_cmd_background);
+    }
+    if (pid == FAIL) {
+        pid = fork();
+    }
+    if (pid != 0 && capture_fd != FAIL) {
+        GlobalSmash().EndOutputCapture();
+    }
+    if (pid < 0 && capture_fd != FAIL) {
+        close(capture_fd);
     }
-    pid_t pid = fork();
     if (pid > 0) {
         if(!this->is_piped) {
         setpgid(pid,pid);
@@ -740,251 +4601,1070 @@ void ExternalCommand::execute() {
         else {
         setpgid(pid,getpgrp());
         }
-        if (is_cmd_background) {
-            global_smash.GetJobsList()->AddJob(this, pid, Background, is_cmd_timeout);
+        if (is_cmd_timeout) {
+            long long deadline_ns = MonotonicNanos() + stoi(args.at(1)) * NANOS_PER_SECOND;
+            if (!GlobalSmash().GetJobStateTable()->Register(pid, GetCmdLine(), deadline_ns)) {
+                cout << "smash error: timeout: too many timed jobs" << endl;
+            }
+            GlobalSmash().GetJobStateTable()->ArmAlarm();
+        }
+        if (is_cmd_background) {
+            JobsList::JobEntry *job = GlobalSmash().GetJobsList()->AddJob(this, pid, Background, is_cmd_timeout);
+            if (capture_fd != FAIL) {
+                GlobalSmash().AddJobOutput(capture_fd, job->GetJobId(), pid);
+            }
+        }
+        else {
+            JobsList::JobEntry *fg_job = new JobsList::JobEntry(-1, Foreground, this, pid, is_cmd_timeout);
+            GlobalSmash().SetForeGroundJob(fg_job);
+            if(this->is_piped){
+                int status = 0;
+                if (waitpid(pid, &status, 0) == FAIL) {
+                 perror("smash error: waitpid failed");
+                 return;
+                }
+                GlobalSmash().SetLastStatus(StatusFromWait(status));
+            }
+            else {
+                GlobalSmash().WaitForegroundJob(fg_job);
+            }
+            if (!GlobalSmash().GetJobsList()->JobPidExists(pid)) { // ***
+                limits.Release();
+                delete fg_job;
+            }
+            GlobalSmash().SetForeGroundJob(nullptr);
+         }
+    }
+    if (pid == 0) {
+        if (!is_piped) { // don't rely on the parent's setpgid, a direct exec may already be done
+            setpgid(0, 0);
+        }
+        if (!is_piped && !is_cmd_background) {
+            GlobalSmash().ClaimTerminal();
+        }
+        placement.Apply();
+        limits.Apply();
+        environ = envp; // exec and the PATH lookup both use smash's variables
+        vector<char*> direct_argv;
+        for (size_t i = 0; i < words.size(); i++) {
+            direct_argv.push_back((char *) words[i].c_str());
+        }
+        direct_argv.push_back(NULL);
+        execvp(direct_argv[0], direct_argv.data());
+        perror("smash error: execvp failed");
+        exit(1);
+    }
+    if (pid < 0) {
+        perror("smash error: fork failed");
+    }
+}
+
+RedirectionCommand::RedirectionCommand(const char *cmd_line) : Command(cmd_line), compiled(nullptr) {
+    const string old_cmd_line = cmd_line;
+    size_t pos = FindUnquoted(old_cmd_line, ">");
+    new_cmd_line = old_cmd_line.substr(0, pos);
+    vector<string> vec1 = vector<string>();
+    if(ParseCommandLine(new_cmd_line.c_str(), vec1) == 0){
+        new_cmd_line = "";
+    }
+    pos++;
+
+    sign = ">";
+    if (old_cmd_line.length() > pos && old_cmd_line[pos] == '>') {
+        sign.push_back('>');
+        pos++;
+    }
+    // the target is kept unexpanded, execute expands it into exactly one word
+    size_t start = old_cmd_line.find_first_not_of(WHITESPACE, pos);
+    size_t end = (start == FIND_FAIL) ? FIND_FAIL : FindUnquoted(old_cmd_line, WHITESPACE + "<>&|", start);
+    file_name = (start == FIND_FAIL) ? "" : old_cmd_line.substr(start, end - start);
+}
+
+RedirectionCommand::RedirectionCommand(const char *cmd_line, const CompiledCommand *compiled) : Command(cmd_line),
+new_cmd_line(compiled->first->line), file_name(compiled->source), sign(compiled->sign), compiled(compiled) {}
+
+void RedirectionCommand::execute() {
+    if(new_cmd_line.compare("") == 0 || file_name.compare("") == 0) {
+        cout << "file_name is empty" << endl;
+        return;
+    }
+    string file_name = this->file_name;
+    if (!(compiled != nullptr ? GlobalSmash().ExpandRedirectTarget(compiled->words, file_name)
+                              : GlobalSmash().ExpandRedirectTarget(file_name))) {
+        return;
+    }
+    int std_out = dup(1); // check it
+    close(1);
+    if(sign.compare(">") == 0) {
+        if(open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666) == FAIL) {
+            perror("smash error: open failed");
+            dup(std_out);
+            close(std_out);
+            return;
+        }
+    }
+    if (sign.compare(">>") == 0) {
+        if (open(file_name.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0666) == FAIL) {
+            perror("smash error: open failed");
+            dup(std_out);
+            close(std_out);
+            return;
+        }
+    }
+    if (compiled != nullptr) {
+        GlobalSmash().RunCompiled(*compiled->first);
+    }
+    else if (IsBuiltInCommand(new_cmd_line)) {
+        GlobalSmash().ExecuteCommand(new_cmd_line.c_str(), true);
+    }
+    else {
+        GlobalSmash().ExecuteCommand(cmd_line, true);
+    }
+    close(1);
+    dup(std_out);
+    close(std_out);
+}
+
+InputRedirectionCommand::InputRedirectionCommand(const char *cmd_line) : Command(cmd_line), compiled(nullptr) {
+    const string old_cmd_line = cmd_line;
+    size_t pos = FindUnquoted(old_cmd_line, "<");
+    is_here_doc = (old_cmd_line.compare(pos, 2, "<<") == 0);
+    size_t start = old_cmd_line.find_first_not_of(WHITESPACE, pos + (is_here_doc ? 2 : 1));
+    size_t end = (start == FIND_FAIL) ? FIND_FAIL : FindUnquoted(old_cmd_line, WHITESPACE + "<>&|", start);
+    file_name = (start == FIND_FAIL) ? "" : old_cmd_line.substr(start, end - start);
+    string rest = (end == FIND_FAIL) ? "" : _trim(old_cmd_line.substr(end));
+    new_cmd_line = _trim(old_cmd_line.substr(0, pos)) + (rest.empty() ? "" : " " + rest);
+}
+
+InputRedirectionCommand::InputRedirectionCommand(const char *cmd_line, const CompiledCommand *compiled) :
+Command(cmd_line), new_cmd_line(compiled->first->line), file_name(compiled->source), is_here_doc(false),
+compiled(compiled) {}
+
+void InputRedirectionCommand::execute() {
+    vector<string> words;
+    if ((compiled == nullptr && ParseCommandLine(new_cmd_line, words) == 0) || file_name.empty()) {
+        cout << "smash error: syntax error near unexpected token `newline'" << endl;
+        return;
+    }
+    string file_name = this->file_name;
+    if (compiled != nullptr && !GlobalSmash().ExpandRedirectTarget(compiled->words, file_name)) {
+        GlobalSmash().SetLastStatus(1);
+        return;
+    }
+    if (compiled == nullptr && !is_here_doc && !GlobalSmash().ExpandRedirectTarget(file_name)) {
+        GlobalSmash().SetLastStatus(1);
+        return;
+    }
+    int fd = is_here_doc ? GlobalSmash().TakeHereDocFd() : open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == FAIL) {
+        if (is_here_doc) {
+            cout << "smash error: here-document is only supported at the prompt" << endl;
+        }
+        else {
+            perror("smash error: open failed");
+        }
+        GlobalSmash().SetLastStatus(1);
+        return;
+    }
+    int std_in = dup(0); // the child reads the file itself, smash never copies it
+    dup2(fd, 0);
+    close(fd);
+    if (compiled != nullptr) {
+        GlobalSmash().RunCompiled(*compiled->first);
+    }
+    else {
+        GlobalSmash().ExecuteCommand(new_cmd_line.c_str());
+    }
+    dup2(std_in, 0);
+    close(std_in);
+}
+
+PipeCommand::PipeCommand(const char *cmd_line) : Command(cmd_line), pipe_size(0), compiled(nullptr) {
+    const string cmd_s = cmd_line;
+    size_t pos = FindUnquoted(cmd_s, "|");
+    first = cmd_s.substr(0, pos);
+    vector<string> vec1 = vector<string>();
+    if(ParseCommandLine(first.c_str(), vec1) == 0) {
+        first = "";
+    }
+    else if(vec1.size() > 2 && vec1[0] == "pipesize" && ParseSize(vec1[1], &pipe_size)) {
+        first = first.substr(SkipWords(first, 2));
+    }
+    pos++;
+
+    sign = "|";
+    if (cmd_s.length() > pos && cmd_s[pos] == '&') {
+        sign.push_back('&');
+        pos++;
+    }
+
+    if (cmd_s.length() > pos) {
+        second = cmd_s.substr(pos);
+        vector<string> vec2 = vector<string>();
+        if(ParseCommandLine(second.c_str(), vec2) == 0){
+            second = "";
+        }
+    } else {
+        second = "";
+    }
+
+    background = IsBackgroundCommand(cmd_line);
+    if(background){
+        second = RemoveBackgroundSign(second);
+    }
+}
+
+PipeCommand::PipeCommand(const char *cmd_line, const CompiledCommand *compiled) : Command(cmd_line),
+sign(compiled->sign), first(compiled->first->line), second(compiled->second->line), background(compiled->background), pipe_size(0), compiled(compiled) {}
+
+// runs one side of the pipe in its forked child
+void PipeCommand::ExecuteStage(bool is_first) {
+    if (compiled != nullptr) {
+        GlobalSmash().RunCompiled(is_first ? *compiled->first : *compiled->second, true);
+    }
+    else {
+        GlobalSmash().ExecuteCommand(is_first ? first.c_str() : second.c_str(), false, true);
+    }
+}
+
+void PipeCommand::execute() {
+    if (first.compare("") == 0 || second.compare("") == 0) {
+        cout << "file_name is empty" << endl;
+        return;
+    }
+    int fd[2];
+    if(pipe(fd) == FAIL){
+        perror("smash error: pipe failed");
+        return;
+    }
+    long long capacity = (pipe_size != 0) ? pipe_size : GlobalSmash().GetPipeSize();
+    if(capacity != 0 && fcntl(fd[1], F_SETPIPE_SZ, (int) min(capacity, (long long) INT32_MAX)) == FAIL) {
+        perror("smash error: fcntl failed");
+    }
+    bool in_process = (compiled != nullptr) ? compiled->first->kind == CompiledCommand::Simple &&
+                                              IsInProcessBuiltIn(compiled->first->name) : IsInProcessBuiltIn(first);
+    if(sign.compare("|") == 0 && in_process && ExecuteInProcessProducer(fd)) {
+        return;
+    }
+    placement = GlobalSmash().TakePlacement(background);
+    limits = GlobalSmash().TakeLimits();
+    pid_t pipe_pid = fork();
+    if(pipe_pid > 0) {
+        setpgid(pipe_pid,pipe_pid);
+        close(fd[0]);
+        close(fd[1]);
+        if(background) {
+            GlobalSmash().GetJobsList()->AddJob(this, pipe_pid, Background);
+        } else {
+            JobsList::JobEntry *fg_job = new JobsList::JobEntry(FAIL, Foreground, this, pipe_pid);
+            GlobalSmash().SetForeGroundJob(fg_job);
+            GlobalSmash().WaitForegroundJob(fg_job);
+            if (!GlobalSmash().GetJobsList()->JobPidExists(pipe_pid)) {
+                limits.Release();
+                delete fg_job;
+            }
+            GlobalSmash().SetForeGroundJob(nullptr);
+        }
+    }
+    if(pipe_pid == 0) {
+        if(!background) {
+            GlobalSmash().ClaimTerminal();
         }
-        else {
-            JobsList::JobEntry *fg_job = new JobsList::JobEntry(-1, Foreground, this, pid, is_cmd_timeout);
-            global_smash.SetForeGroundJob(fg_job);
-            if(this->is_piped){
-                if (waitpid(pid, NULL, 0) == FAIL) {
-                 perror("smash error: waitpid failed");
-                 return;
+        placement.Apply();
+        limits.Apply();
+        pid_t first_cmd_pid = fork();
+        if(first_cmd_pid > 0) {
+            setpgid(first_cmd_pid,getpgrp());
+            pid_t second_cmd_pid = fork();
+            if (second_cmd_pid > 0) {
+                setpgid(second_cmd_pid,getpgrp());
+                close(fd[0]);
+                close(fd[1]);
+                int status = 0;
+                if(waitpid(second_cmd_pid, &status, 0) == FAIL || waitpid(first_cmd_pid, NULL, 0) == FAIL) {
+                    perror("smash error: waitpid failed");
                 }
+                exit(StatusFromWait(status)); // the pipeline's status is its last stage's
             }
-            else if (waitpid(pid, NULL, WUNTRACED) == FAIL) {
-            perror("smash error: waitpid failed");
-            return;
+            if (second_cmd_pid == 0) {
+                dup2(fd[0], 0);
+                close(fd[0]);
+                close(fd[1]);
+                ExecuteStage(false);
+                exit(GlobalSmash().GetLastStatus());
             }
-            if (!global_smash.GetJobsList()->JobPidExists(pid)) { // ***
-                delete fg_job;
+            if (second_cmd_pid < 0) {
+                perror("smash error: fork failed");
             }
-            global_smash.SetForeGroundJob(nullptr);
-         }
-         delete[] cmd_line;
+        }
+        if (first_cmd_pid == 0 ) { // src
+            if(sign.compare("|") == 0){
+                dup2(fd[1], 1);
+            }
+            else {
+                dup2(fd[1], 2);
+            }
+            close(fd[0]);
+            close(fd[1]);
+            ExecuteStage(true);
+            exit(0);
+        }
+        if (first_cmd_pid < 0) {
+            perror("smash error: fork failed");
+        }
     }
-    if (pid == 0) {
-        char *argv[] = {(char *) "/bin/bash", (char *) "-c", cmd_line, NULL};
+    if (pipe_pid < 0) {
+        perror("smash error: fork failed");
+    }
+}
+
+bool PipeCommand::ExecuteInProcessProducer(int fd[2]) {
+    if(compiled == nullptr && (IsRedirectionCommand(first.c_str()) || IsInputRedirectionCommand(first.c_str()))) {
+        return false;
+    }
+    Command* cmd = (compiled != nullptr) ? GlobalSmash().CreateCompiled(*compiled->first, true)
+                                         : GlobalSmash().CreateCommand(first.c_str(), false, true, false);
+    BuiltInCommand* producer = dynamic_cast<BuiltInCommand*>(cmd);
+    if(producer == nullptr && cmd != nullptr) { // not a plain builtin after all, the forked path runs it
+        delete cmd;
+        return false;
+    }
+    ostringstream output;
+    // a failed expansion is already reported, the consumer just sees no input
+    if(producer != nullptr && !producer->ExpansionFailed()) {
+        producer->SetOutput(&output);
+        producer->execute();
+    }
+    delete producer;
+    const string data = output.str();
+    int capacity = fcntl(fd[1], F_GETPIPE_SZ);
+    if(capacity != FAIL && (size_t) capacity < data.size() && fcntl(fd[1], F_SETPIPE_SZ, data.size()) != FAIL) {
+        capacity = fcntl(fd[1], F_GETPIPE_SZ);
+    }
+    // output that fits the empty pipe is written by smash right away, anything larger would block
+    // smash until the consumer reads it, so a writer child inside the job feeds it instead
+    bool fits = capacity != FAIL && (size_t) capacity >= data.size();
+    if(fits && !WriteFully(fd[1], data)) {
+        perror("smash error: write failed");
+    }
+
+    placement = GlobalSmash().TakePlacement(background);
+    limits = GlobalSmash().TakeLimits();
+    pid_t pipe_pid = fork();
+    if(pipe_pid == 0) {
+        setpgid(0, 0);
+        if(!background) {
+            GlobalSmash().ClaimTerminal();
+        }
+        placement.Apply();
+        limits.Apply();
+        pid_t writer_pid = fits ? FAIL : fork();
+        if(writer_pid == 0) {
+            signal(SIGINT, SIG_DFL); // it never execs, ctrl-C and ctrl-Z must not run smash's handlers
+            signal(SIGTSTP, SIG_DFL);
+            close(fd[0]);
+            _exit(WriteFully(fd[1], data) ? 0 : 1);
+        }
+        dup2(fd[0], 0);
+        close(fd[0]);
+        close(fd[1]);
+        ExecuteStage(false);
+        int status = GlobalSmash().GetLastStatus();
+        close(0); // a consumer that stopped reading early must not leave the writer blocked
+        if(writer_pid > 0 && waitpid(writer_pid, NULL, 0) == FAIL) {
+            perror("smash error: waitpid failed");
+        }
+        exit(status);
+    }
+    if(pipe_pid < 0) {
+        perror("smash error: fork failed");
+        close(fd[0]);
+        close(fd[1]);
+        return true;
+    }
+    setpgid(pipe_pid,pipe_pid);
+    close(fd[0]);
+    close(fd[1]);
+    if(background) {
+        GlobalSmash().GetJobsList()->AddJob(this, pipe_pid, Background);
+    } else {
+        JobsList::JobEntry *fg_job = new JobsList::JobEntry(FAIL, Foreground, this, pipe_pid);
+        GlobalSmash().SetForeGroundJob(fg_job);
+        GlobalSmash().WaitForegroundJob(fg_job);
+        if (!GlobalSmash().GetJobsList()->JobPidExists(pipe_pid)) {
+            limits.Release();
+            delete fg_job;
+        }
+        GlobalSmash().SetForeGroundJob(nullptr);
+    }
+    return true;
+}
+
+// where a cpuset, numa or limit prefix at the start of line ends, FIND_FAIL when there is none
+static size_t SkipPrefixCommand(const string &line) {
+    vector<string> words;
+    int count = ParseCommandLine(line, words);
+    if (count == 0 || (words[0] != "cpuset" && words[0] != "numa" && words[0] != "limit")) {
+        return FIND_FAIL;
+    }
+    int i = 2;
+    if (words[0] == "limit") {
+        i = 1;
+        while (i + 1 < count && words[i].compare(0, 2, "--") == 0) {
+            i += 2;
+        }
+    }
+    return (i < count) ? SkipWords(line, i) : line.size(); // the prefix itself reports a missing command
+}
+
+TimeoutCommand::TimeoutCommand(const char *cmd_line) : Command(cmd_line) {
+    if(num_of_args < 3 || !IsStringNumber(args[1]) || args[1].size() > 9 || stoi(args[1]) < 0) {
+        return;
+    }
+    duration = stoi(args[1]);
+    string old_cmd = cmd_line;
+    new_cmd_line = old_cmd.substr(SkipWords(old_cmd, 2));
+}
+
+void TimeoutCommand::execute() {
+    if(num_of_args < 3 || !IsStringNumber(args[1]) || args[1].size() > 9 || stoi(args[1]) < 0){
+        cout << "smash error: timeout: invalid arguments" << endl;
+        return;
+    }
+
+    size_t prefix_end = SkipPrefixCommand(new_cmd_line);
+    if (prefix_end != FIND_FAIL) { // the prefix goes outside, its placement or limits then reach the timed child
+        string hoisted = new_cmd_line.substr(0, prefix_end) + " timeout " + args[1] + " " +
+                         _ltrim(new_cmd_line.substr(prefix_end));
+        GlobalSmash().ExecuteCommand(hoisted.c_str());
+        return;
+    }
+    if (IsBuiltInCommand(new_cmd_line)) { // an external command arms the alarm once its deadline is registered
+        GlobalSmash().GetJobStateTable()->ArmAlarm(duration * NANOS_PER_SECOND);
+        GlobalSmash().ExecuteCommand(new_cmd_line.c_str(), false, false, true);
+    }
+    else {
+        GlobalSmash().ExecuteCommand(cmd_line, false, false, true);
+    }
+}
+
+CpusetCommand::CpusetCommand(const char *cmd_line, bool isPiped, bool isTimeout) : Command(cmd_line),
+is_piped(isPiped), is_timeout(isTimeout), valid(false) {
+    cpu_set_t cpus;
+    if(num_of_args < 3 || !JobPlacement::ParseCpuList(args[1], &cpus)) {
+        return;
+    }
+    prefix_placement.SetCpus(cpus);
+    string old_cmd = cmd_line;
+    size_t pos = old_cmd.find(args[1]) + args[1].size();
+    new_cmd_line = _ltrim(old_cmd.substr(pos));
+    valid = true;
+}
+
+void CpusetCommand::execute() {
+    if(!valid) {
+        cout << "smash error: cpuset: invalid arguments" << endl;
+        return;
+    }
+    GlobalSmash().AddPendingPlacement(prefix_placement);
+    GlobalSmash().ExecuteCommand(new_cmd_line.c_str(), false, is_piped, is_timeout);
+    GlobalSmash().ClearPendingPlacement();
+}
+
+NumaCommand::NumaCommand(const char *cmd_line, bool isPiped, bool isTimeout) : Command(cmd_line),
+is_piped(isPiped), is_timeout(isTimeout), valid(false), node(-1), has_node_cpus(false) {
+    CPU_ZERO(&node_cpus);
+    if(num_of_args < 3 || args[1].size() > 4 || !IsStringNumber(args[1]) || args[1][0] == '-') {
+        return;
+    }
+    node = stoi(args[1]);
+    string node_path = NUMA_NODE_PATH + to_string(node);
+    if(node >= NUMA_MAX_NODES || access(node_path.c_str(), F_OK) != 0) {
+        return;
+    }
+    ifstream cpulist_file(node_path + "/cpulist");
+    string cpulist;
+    if(getline(cpulist_file, cpulist)) {
+        has_node_cpus = JobPlacement::ParseCpuList(_trim(cpulist), &node_cpus);
+    }
+    string old_cmd = cmd_line;
+    size_t pos = old_cmd.find(args[1]) + args[1].size();
+    new_cmd_line = _ltrim(old_cmd.substr(pos));
+    valid = true;
+}
+
+void NumaCommand::execute() {
+    if(!valid) {
+        cout << "smash error: numa: invalid arguments" << endl;
+        return;
+    }
+    JobPlacement prefix_placement;
+    prefix_placement.SetNumaNode(node);
+    if(has_node_cpus && !GlobalSmash().HasPendingCpus()) { // an explicit cpuset wins over the node's cpus
+        prefix_placement.SetCpus(node_cpus);
+    }
+    GlobalSmash().AddPendingPlacement(prefix_placement);
+    GlobalSmash().ExecuteCommand(new_cmd_line.c_str(), false, is_piped, is_timeout);
+    GlobalSmash().ClearPendingPlacement();
+}
+
+LimitCommand::LimitCommand(const char *cmd_line, bool isPiped, bool isTimeout) : Command(cmd_line),
+is_piped(isPiped), is_timeout(isTimeout), valid(false) {
+    string old_cmd = cmd_line;
+    int i = 1;
+    while(i + 1 < num_of_args && args[i].compare(0, 2, "--") == 0) {
+        if(!prefix_limits.ParseOption(args[i], args[i + 1])) {
+            return;
+        }
+        i += 2;
+    }
+    if(i == 1 || i >= num_of_args) {
+        return;
+    }
+    new_cmd_line = _ltrim(old_cmd.substr(SkipWords(old_cmd, i)));
+    valid = true;
+}
+
+void LimitCommand::execute() {
+    if(!valid) {
+        cout << "smash error: limit: invalid arguments" << endl;
+        return;
+    }
+    // RLIMIT_NPROC counts every process of the user, only a pids cgroup limits the job itself
+    if(prefix_limits.HasPids() && GlobalSmash().GetCgroupRoot().empty()) {
+        cout << "smash error: limit: --pids needs a delegated cgroup" << endl;
+        return;
+    }
+    GlobalSmash().AddPendingLimits(prefix_limits);
+    GlobalSmash().ExecuteCommand(new_cmd_line.c_str(), false, is_piped, is_timeout);
+    GlobalSmash().ClearPendingLimits();
+}
+
+CoprocCommand::CoprocCommand(const char *cmd_line) : Command(cmd_line) {
+    if(num_of_args < 3) {
+        return;
+    }
+    name = args[1];
+    string old_cmd = RemoveBackgroundSign(string(cmd_line));
+    size_t pos = SkipWords(old_cmd, 2);
+    new_cmd_line = (pos == FIND_FAIL) ? "" : _trim(old_cmd.substr(pos));
+}
+
+void CoprocCommand::execute() {
+    if(num_of_args < 3 || new_cmd_line.empty()) {
+        cout << "smash error: coproc: invalid arguments" << endl;
+        return;
+    }
+    if(GlobalSmash().GetCoproc(name) != nullptr) {
+        cout << "smash error: coproc: " << name << " already exists" << endl;
+        return;
+    }
+    int to_child[2];
+    int from_child[2];
+    if(pipe2(to_child, O_CLOEXEC) == FAIL) {
+        perror("smash error: pipe failed");
+        return;
+    }
+    if(pipe2(from_child, O_CLOEXEC) == FAIL) {
+        perror("smash error: pipe failed");
+        close(to_child[0]);
+        close(to_child[1]);
+        return;
+    }
+    placement = GlobalSmash().TakePlacement(true);
+    limits = GlobalSmash().TakeLimits();
+    char **envp = GlobalSmash().GetEnvironment()->GetEnvp();
+    pid_t pid = fork();
+    if(pid == 0) {
+        setpgrp();
+        placement.Apply();
+        limits.Apply();
+        environ = envp;
+        dup2(to_child[0], 0);
+        dup2(from_child[1], 1);
+        char *argv[] = {(char *) "/bin/bash", (char *) "-c", (char *) new_cmd_line.c_str(), NULL};
         execv(argv[0], argv);
         perror("smash error: execv failed");
+        exit(1);
     }
-    if (pid < 0) {
+    close(to_child[0]);
+    close(from_child[1]);
+    if(pid < 0) {
         perror("smash error: fork failed");
+        close(to_child[1]);
+        close(from_child[0]);
+        return;
     }
+    setpgid(pid, pid);
+    fcntl(to_child[1], F_SETFL, O_NONBLOCK);
+    fcntl(from_child[0], F_SETFL, O_NONBLOCK);
+    GlobalSmash().GetJobsList()->AddJob(this, pid, Background);
+    GlobalSmash().AddCoproc(name, new CoprocEntry(name, pid, to_child[1], from_child[0]));
 }
 
-RedirectionCommand::RedirectionCommand(const char *cmd_line) : Command(cmd_line) {
-    const string old_cmd_line = cmd_line;
-    size_t pos = old_cmd_line.find('>');
-    new_cmd_line = old_cmd_line.substr(0, pos);
-    vector<string> vec1 = vector<string>();
-    if(ParseCommandLine(new_cmd_line.c_str(), vec1) == 0){
-        new_cmd_line = "";
+void SendCommand::execute() {
+    if(num_of_args < 2) {
+        cout << "smash error: send: invalid arguments" << endl;
+        return;
     }
-    pos++;
+    CoprocEntry* coproc = GlobalSmash().GetCoproc(args[1]);
+    if(coproc == nullptr) {
+        cout << "smash error: send: " << args[1] << " does not exist" << endl;
+        return;
+    }
+    string old_cmd = RemoveBackgroundSign(string(cmd_line));
+    size_t pos = SkipWords(old_cmd, 2);
+    string data = (pos < old_cmd.size()) ? old_cmd.substr(pos + 1) : "";
+    if(data.find_first_of("$'\"\\~") != FIND_FAIL) { // keep the spacing unless the words were expanded
+        data.clear();
+        for (int i = 2; i < num_of_args; i++) {
+            data += (i > 2 ? " " : "") + args[i];
+        }
+    }
+    if(!coproc->Send(data + "\n")) {
+        cout << "smash error: send: " << args[1] << " is closed" << endl;
+    }
+}
 
-    sign = ">";
-    if (old_cmd_line.length() > pos && old_cmd_line[pos] == '>') {
-        sign.push_back('>');
-        pos++;
+void RecvCommand::execute() {
+    if(num_of_args != 2) {
+        cout << "smash error: recv: invalid arguments" << endl;
+        return;
     }
-    if (old_cmd_line.length() > pos) {
-        string restOfCmd = old_cmd_line.substr(pos);
-        vector<string> vec2 = vector<string>();
-        if(ParseCommandLine(restOfCmd.c_str(), vec2) == 0){
-            file_name = "";
-        } else {
-            file_name = vec2.at(0);
+    CoprocEntry* coproc = GlobalSmash().GetCoproc(args[1]);
+    if(coproc == nullptr) {
+        cout << "smash error: recv: " << args[1] << " does not exist" << endl;
+        return;
+    }
+    *out << coproc->Receive() << flush;
+}
+
+void PipeSizeCommand::execute() {
+    long long size = 0;
+    if(num_of_args == 1) {
+        long long current = GlobalSmash().GetPipeSize();
+        *out << "smash: pipe size is " << (current == 0 ? "default" : to_string(current)) << endl;
+        return;
+    }
+    if(num_of_args == 2 && args.at(1) == "default") {
+        GlobalSmash().SetPipeSize(0);
+    }
+    else if(num_of_args == 2 && ParseSize(args.at(1), &size)) {
+        GlobalSmash().SetPipeSize(size);
+    }
+    else {
+        cout << "smash error: pipesize: invalid arguments" << endl;
+    }
+}
+
+void PassthruCommand::CopyWithReadWrite(int file_fd) {
+    char buff[READBLOCK];
+    ssize_t r_value;
+    while((r_value = read(0, buff, READBLOCK)) != 0) {
+        if(r_value == FAIL) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("smash error: read failed");
+            return;
         }
-        if(file_name.back() == '&'){
-            file_name.pop_back();
+        if(write(1, buff, r_value) == FAIL || (file_fd != FAIL && write(file_fd, buff, r_value) == FAIL)) {
+            perror("smash error: write failed");
+            return;
         }
-    } else {
-        file_name = "";
     }
 }
 
-void RedirectionCommand::execute() {
-    if(new_cmd_line.compare("") == 0 || file_name.compare("") == 0) {
-        cout << "file_name is empty" << endl;
+void PassthruCommand::execute() {
+    if(num_of_args > 2) {
+        cout << "smash error: passthru: invalid arguments" << endl;
         return;
     }
-    int std_out = dup(1); // check it
-    close(1);
-    if(sign.compare(">") == 0) {
-        if(open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666) == FAIL) {
-            perror("smash error: open failed");
-            dup(std_out);
-            close(std_out);
-            return;
+    if(!GlobalSmash().IsSmashPid(getpid())) { // already a forked pipe stage
+        Passthru();
+        return;
+    }
+    // at the prompt it reads the terminal, so it runs as a job of its own instead of inside smash
+    bool is_background = IsBackgroundCommand(GetCmdLine());
+    placement = GlobalSmash().TakePlacement(is_background);
+    limits = GlobalSmash().TakeLimits();
+    cout.flush();
+    pid_t pid = fork();
+    if(pid < 0) {
+        perror("smash error: fork failed");
+        return;
+    }
+    if(pid == 0) {
+        setpgid(0, 0);
+        signal(SIGINT, SIG_DFL); // it never execs, the terminal's signals must not run smash's handlers
+        signal(SIGTSTP, SIG_DFL);
+        if(!is_background) {
+            GlobalSmash().ClaimTerminal();
         }
+        placement.Apply();
+        limits.Apply();
+        Passthru();
+        cout.flush();
+        exit(0);
     }
-    if (sign.compare(">>") == 0) {
-        if (open(file_name.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0666) == FAIL) {
-            perror("smash error: open failed");
-            dup(std_out);
-            close(std_out);
-            return;
+    setpgid(pid, pid);
+    if(is_background) {
+        GlobalSmash().GetJobsList()->AddJob(this, pid, Background);
+        return;
+    }
+    JobsList::JobEntry *fg_job = new JobsList::JobEntry(FAIL, Foreground, this, pid);
+    GlobalSmash().SetForeGroundJob(fg_job);
+    GlobalSmash().WaitForegroundJob(fg_job);
+    if (!GlobalSmash().GetJobsList()->JobPidExists(pid)) {
+        limits.Release();
+        delete fg_job;
+    }
+    GlobalSmash().SetForeGroundJob(nullptr);
+}
+
+void PassthruCommand::Passthru() {
+    int file_fd = FAIL;
+    if(num_of_args == 2 && (file_fd = open(args.at(1).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666)) == FAIL) {
+        perror("smash error: open failed");
+        return;
+    }
+    cout.flush();
+    struct stat in_stat, out_stat;
+    bool in_pipe = fstat(0, &in_stat) == 0 && S_ISFIFO(in_stat.st_mode);
+    bool out_pipe = fstat(1, &out_stat) == 0 && S_ISFIFO(out_stat.st_mode);
+    // splice needs a pipe on one side, tee needs pipes on both; the data never passes through smash
+    bool zero_copy = (file_fd == FAIL) ? (in_pipe || out_pipe) : (in_pipe && out_pipe);
+    while(zero_copy) {
+        ssize_t moved;
+        if(file_fd == FAIL) {
+            moved = splice(0, NULL, 1, NULL, SPLICE_BLOCK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        }
+        else {
+            moved = tee(0, 1, SPLICE_BLOCK, 0);
+            for(ssize_t left = moved; left > 0;) {
+                ssize_t spliced = splice(0, NULL, file_fd, NULL, left, SPLICE_F_MOVE);
+                if(spliced == FAIL && errno == EINTR) {
+                    continue;
+                }
+                if(spliced <= 0) {
+                    perror("smash error: splice failed");
+                    close(file_fd);
+                    return;
+                }
+                left -= spliced;
+            }
+        }
+        if(moved == 0) {
+            break;
+        }
+        if(moved == FAIL && errno == EINTR) {
+            continue;
+        }
+        if(moved == FAIL && errno == EINVAL) { // e.g. stdout is a terminal
+            zero_copy = false;
+            break;
         }
+        if(moved == FAIL) {
+            perror("smash error: splice failed");
+            break;
+        }
+    }
+    if(!zero_copy) {
+        CopyWithReadWrite(file_fd);
+    }
+    if(file_fd != FAIL) {
+        close(file_fd);
+    }
+}
+
+void CpuPolicyCommand::execute() {
+    if(num_of_args == 1) {
+        *out << "smash: cpu policy is " << (GlobalSmash().GetCpuPolicy() == RoundRobin ? "rr" : "none") << endl;
+        return;
+    }
+    if(num_of_args == 2 && args.at(1) == "rr") {
+        GlobalSmash().SetCpuPolicy(RoundRobin);
+    }
+    else if(num_of_args == 2 && args.at(1) == "none") {
+        GlobalSmash().SetCpuPolicy(NoPolicy);
+    }
+    else {
+        cout << "smash error: cpupolicy: invalid arguments" << endl;
+    }
+}
+
+IoUring::~IoUring() {
+    if (buffers != nullptr) {
+        munmap(buffers, buffers_size);
+    }
+    if (sqes != nullptr) {
+        munmap(sqes, sqes_size);
+    }
+    if (cq_ring != nullptr && cq_ring != sq_ring) {
+        munmap(cq_ring, cq_ring_size);
+    }
+    if (sq_ring != nullptr) {
+        munmap(sq_ring, sq_ring_size);
+    }
+    if (ring_fd != FAIL) {
+        close(ring_fd);
     }
-    if (IsBuiltInCommand(new_cmd_line)) {
-        global_smash.ExecuteCommand(new_cmd_line.c_str(), true);
+}
+
+bool IoUring::Setup(unsigned entries) {
+#ifdef __NR_io_uring_setup
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd == FAIL) {
+        return false;
+    }
+    this->entries = params.sq_entries;
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) { // both rings share one mapping
+        sq_ring_size = cq_ring_size = max(sq_ring_size, cq_ring_size);
+    }
+    void *mapped = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+    sq_ring = mapped;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ring = sq_ring;
     }
     else {
-        global_smash.ExecuteCommand(cmd_line, true);
+        mapped = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (mapped == MAP_FAILED) {
+            return false;
+        }
+        cq_ring = mapped;
     }
-    close(1);
-    dup(std_out);
-    close(std_out);
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    mapped = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+    sqes = static_cast<io_uring_sqe *>(mapped);
+    char *sq = static_cast<char *>(sq_ring);
+    char *cq = static_cast<char *>(cq_ring);
+    sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    return true;
+#else
+    errno = ENOSYS;
+    return false;
+#endif
 }
 
-PipeCommand::PipeCommand(const char *cmd_line) : Command(cmd_line) {
-    const string cmd_s = cmd_line;
-    size_t pos = cmd_s.find('|');
-    first = cmd_s.substr(0, pos);
-    vector<string> vec1 = vector<string>();
-    if(ParseCommandLine(first.c_str(), vec1) == 0) {
-        first = "";
+// page aligned, so the same buffers also work under O_DIRECT
+bool IoUring::RegisterBuffers(unsigned count, size_t size) {
+    buffers_size = count * size;
+    void *mapped = mmap(NULL, buffers_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) {
+        return false;
     }
-    pos++;
+    buffers = static_cast<char *>(mapped);
+    buffer_size = size;
+    vector<struct iovec> iovecs(count);
+    for (unsigned i = 0; i < count; i++) {
+        iovecs[i].iov_base = Buffer(i);
+        iovecs[i].iov_len = size;
+    }
+    return syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, iovecs.data(), count) == SUCC;
+}
 
-    sign = "|";
-    if (cmd_s.length() > pos && cmd_s[pos] == '&') {
-        sign.push_back('&');
-        pos++;
+// the buffer index doubles as user_data, skip resumes a short transfer inside the buffer
+bool IoUring::QueueFixed(uint8_t opcode, int fd, unsigned buf_index, size_t skip, unsigned length, off_t offset) {
+    unsigned tail = *sq_tail;
+    if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= entries) {
+        return false;
     }
+    unsigned index = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(Buffer(buf_index) + skip);
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->buf_index = buf_index;
+    sqe->user_data = buf_index;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    to_submit++;
+    return true;
+}
 
-    if (cmd_s.length() > pos) {
-        second = cmd_s.substr(pos);
-        vector<string> vec2 = vector<string>();
-        if(ParseCommandLine(second.c_str(), vec2) == 0){
-            second = "";
+bool IoUring::Submit(unsigned wait_for) {
+    while (true) {
+        int submitted = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_for,
+                                wait_for > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (submitted == FAIL && errno == EINTR) {
+            continue;
         }
-    } else {
-        second = "";
+        if (submitted == FAIL) {
+            return false;
+        }
+        to_submit -= submitted;
+        return true;
     }
+}
 
-    background = IsBackgroundCommand(cmd_line);
-    if(background){
-        second = RemoveBackgroundSign(second);
+bool IoUring::Reap(uint64_t &user_data, int &result) {
+    unsigned head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
     }
+    struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+    user_data = cqe->user_data;
+    result = cqe->res;
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
 }
 
-void PipeCommand::execute() {
-    if (first.compare("") == 0 || second.compare("") == 0) {
-        cout << "file_name is empty" << endl;
-        return;
-    }
-    int fd[2];
-    if(pipe(fd) == FAIL){
-        perror("smash error: pipe failed");
-        return;
-    }
-    pid_t pipe_pid = fork();
-    if(pipe_pid > 0) {
-        setpgid(pipe_pid,pipe_pid);
-        close(fd[0]);
-        close(fd[1]);
-        if(background) {
-            global_smash.GetJobsList()->AddJob(this, pipe_pid, Background);
-        } else {
-            JobsList::JobEntry *fg_job = new JobsList::JobEntry(FAIL, Foreground, this, pipe_pid);
-            global_smash.SetForeGroundJob(fg_job);
-            if (waitpid(pipe_pid, NULL, WUNTRACED) == FAIL) {
-                perror("smash error: waitpid failed");
-            }
-            if (!global_smash.GetJobsList()->JobPidExists(pipe_pid)) {
-                delete fg_job;
-            }
-            global_smash.SetForeGroundJob(nullptr);
-        }
-    }
-    if(pipe_pid == 0) {
-        pid_t first_cmd_pid = fork();
-        if(first_cmd_pid > 0) {
-            setpgid(first_cmd_pid,getpgrp());
-            pid_t second_cmd_pid = fork();
-            if (second_cmd_pid > 0) {
-                setpgid(second_cmd_pid,getpgrp());
-                close(fd[0]);
-                close(fd[1]);
-                if(waitpid(second_cmd_pid, NULL, 0) == FAIL || waitpid(first_cmd_pid, NULL, 0) == FAIL) {
-                    perror("smash error: waitpid failed");
-                }
-                exit(0);
-            }
-            if (second_cmd_pid == 0) {
-                dup2(fd[0], 0);
-                close(fd[0]);
-                close(fd[1]);
-                global_smash.ExecuteCommand(second.c_str(), false, true);
-                exit(0);
-            }
-            if (second_cmd_pid < 0) {
-                perror("smash error: fork failed");
+// CRC32C (Castagnoli), slicing-by-8 in software and the SSE4.2 instruction where the cpu has it
+static uint32_t Crc32cSoftware(uint32_t crc, const unsigned char *data, size_t size) {
+    static uint32_t table[8][256];
+    static bool table_ready = false;
+    if (!table_ready) {
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
             }
+            table[0][n] = c;
         }
-        if (first_cmd_pid == 0 ) { // src
-            if(sign.compare("|") == 0){
-                dup2(fd[1], 1);
+        for (uint32_t n = 0; n < 256; n++) {
+            for (int slice = 1; slice < 8; slice++) {
+                table[slice][n] = (table[slice - 1][n] >> 8) ^ table[0][table[slice - 1][n] & 0xff];
             }
-            else {
-                dup2(fd[1], 2);
-            }
-            close(fd[0]);
-            close(fd[1]);
-            global_smash.ExecuteCommand(first.c_str(), false, true);
-            exit(0);
-        }
-        if (first_cmd_pid < 0) {
-            perror("smash error: fork failed");
         }
+        table_ready = true;
     }
-    if (pipe_pid < 0) {
-        perror("smash error: fork failed");
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; size >= 8; data += 8, size -= 8) {
+        uint32_t low, high;
+        memcpy(&low, data, sizeof(low));
+        memcpy(&high, data + 4, sizeof(high));
+        low ^= crc;
+        crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^ table[5][(low >> 16) & 0xff] ^ table[4][low >> 24] ^
+              table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff] ^ table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+    }
+#endif
+    for (; size > 0; data++, size--) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *data) & 0xff];
     }
+    return crc;
 }
 
-TimeoutCommand::TimeoutCommand(const char *cmd_line) : Command(cmd_line) {
-    if(num_of_args < 3 || !IsStringNumber(args[1]) || stoi(args[1]) < 0) {
-        return;
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t Crc32cHardware(uint32_t crc, const unsigned char *data, size_t size) {
+    uint64_t crc64 = crc;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
     }
-    duration = stoi(args[1]);
-    string old_cmd = cmd_line;
-    int pos = old_cmd.find(args[1]) + args[1].size();
-    new_cmd_line = old_cmd.substr(pos);
+    crc = static_cast<uint32_t>(crc64);
+    for (; size > 0; data++, size--) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+    return crc;
 }
+#endif
 
-void TimeoutCommand::execute() {
-    if(num_of_args < 3 || !IsStringNumber(args[1]) || stoi(args[1]) < 0){
-        cout << "smash error: timeout: invalid arguments" << endl;
-        return;
+// crc starts at ~0 and the final value is ~crc, as usual
+static uint32_t Crc32cUpdate(uint32_t crc, const char *data, size_t size) {
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+#if defined(__x86_64__)
+    static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+    if (has_sse42) {
+        return Crc32cHardware(crc, bytes, size);
     }
+#endif
+    return Crc32cSoftware(crc, bytes, size);
+}
 
-    int min_smash_time = global_smash.GetJobsList()->GetClosestTimeout();
-    if(min_smash_time == -1) {
-        alarm(duration);
-    }
-    else {
-        int new_dur = min(duration, min_smash_time);
-        alarm(new_dur);
-    }
+static bool SetDirectIo(int fd, bool on) {
+    int flags = fcntl(fd, F_GETFL);
+    return flags != FAIL && fcntl(fd, F_SETFL, on ? (flags | O_DIRECT) : (flags & ~O_DIRECT)) != FAIL;
+}
 
-    if (IsBuiltInCommand(new_cmd_line)) {
-        global_smash.ExecuteCommand(new_cmd_line.c_str(), false, false, true);
+// read() until size bytes or end of file, returns the count or FAIL
+static ssize_t ReadFull(int fd, char *data, size_t size) {
+    size_t count = 0;
+    while (count < size) {
+        ssize_t r_value = read(fd, data + count, size - count);
+        if (r_value == FAIL && errno == EINTR) {
+            continue;
+        }
+        if (r_value == FAIL) {
+            return FAIL;
+        }
+        if (r_value == 0) {
+            break;
+        }
+        count += r_value;
     }
-    else {
-        global_smash.ExecuteCommand(cmd_line, false, false, true);
+    return count;
+}
+
+static bool PwriteFull(int fd, const char *data, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t w_value = pwrite(fd, data, size, offset);
+        if (w_value == FAIL && errno == EINTR) {
+            continue;
+        }
+        if (w_value == FAIL) {
+            return false;
+        }
+        data += w_value;
+        size -= w_value;
+        offset += w_value;
     }
+    return true;
 }
 
 CopyCommand::CopyCommand(const char *cmd_line) :BuiltInCommand(cmd_line) {
-    if((num_of_args < 3) || ((num_of_args == 3) && (args.at(2).compare("&") == 0))) {
+    vector<string> files;
+    for (int i = 1; i < num_of_args; i++) {
+        string arg = RemoveBackgroundSign(args[i]);
+        if (files.empty() && args[i] == "--resume") {
+            resume = true;
+        }
+        else if (files.empty() && args[i] == "--verify") {
+            verify = true;
+        }
+        else if (files.empty() && args[i] == "--direct") {
+            direct = true;
+        }
+        else if (files.empty() && args[i].compare(0, 7, "--uring") == 0) { // --uring[=DEPTH]
+            string depth = (args[i].size() > 8 && args[i][7] == '=') ? args[i].substr(8) : "";
+            if (args[i] != "--uring" && (depth.size() > 2 || !IsStringNumber(depth) || stoi(depth) == 0 ||
+                                         stoi(depth) > COPY_URING_MAX_DEPTH)) {
+                return;
+            }
+            uring_depth = depth.empty() ? COPY_URING_DEPTH : stoi(depth);
+        }
+        else if (!arg.empty()) {
+            files.push_back(arg);
+        }
+    }
+    if(files.size() < 2) {
         return;
     }
+    valid_args = true;
     is_background = IsBackgroundCommand(cmd_line);
-    src_file = args[1];
-    dst_file = RemoveBackgroundSign(args[2]);
+    src_file = files[0];
+    dst_file = files[1];
     src_file_full = realpath(src_file.c_str(), NULL);
     if(src_file_full == NULL) {
         return;
@@ -995,24 +5675,31 @@ CopyCommand::CopyCommand(const char *cmd_line) :BuiltInCommand(cmd_line) {
         //dstFileFD = open(dstFile.c_str(), O_WRONLY, 0666);
     }
     else{
+        // --resume keeps what is already there, --verify reads the copy back
+        int dst_flags = O_CREAT | (resume ? 0 : O_TRUNC) | ((resume || verify) ? O_RDWR : O_WRONLY);
         src_file_failed = open(src_file.c_str(), O_RDONLY, 0666);
-        dst_file_failed = open(dst_file.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0666);
+        dst_file_failed = open(dst_file.c_str(), dst_flags, 0666);
         if(dst_file_full == NULL) {
             dst_file_full = realpath(dst_file.c_str(), NULL);
         }
     }
 
-    buff = new char[READBLOCK];
+    buff = new char[COPY_BLOCK];
 }
 
 CopyCommand::~CopyCommand(){
-    if((num_of_args < 3) || ((num_of_args == 3) && (args.at(2).compare("&") == 0)) || src_file_full == NULL) {
+    if(!valid_args || src_file_full == NULL) {
         return;
     }
-    if(dst_file_full != NULL && strcmp(src_file_full, dst_file_full) == 0) {
+    if(src_file_failed != FAIL) {
         close(src_file_failed);
+    }
+    if(dst_file_failed != FAIL) {
         close(dst_file_failed);
     }
+    if(progress != nullptr) {
+        munmap(progress, sizeof(CopyProgress));
+    }
     if(src_file_full != NULL) {
         free(src_file_full);
     }
@@ -1022,8 +5709,310 @@ CopyCommand::~CopyCommand(){
     delete[] buff;
 }
 
+int CopyCommand::Progress() {
+    if(progress == nullptr) {
+        return FAIL;
+    }
+    long long total = progress->total.load();
+    return total == 0 ? 100 : static_cast<int>(progress->done.load() * 100 / total);
+}
+
+// --resume: walks both files while they agree and leaves both offsets at the first differing byte
+off_t CopyCommand::SkipMatchingPrefix(uint32_t &src_crc) {
+    vector<char> existing(COPY_BLOCK);
+    off_t offset = 0;
+    while (true) {
+        ssize_t src_count = ReadFull(src_file_failed, buff, COPY_BLOCK);
+        ssize_t dst_count = (src_count > 0) ? ReadFull(dst_file_failed, existing.data(), src_count) : 0;
+        if(src_count == FAIL || dst_count == FAIL) {
+            perror("smash error: read failed");
+            return FAIL;
+        }
+        ssize_t same = 0;
+        if(dst_count == src_count && memcmp(buff, existing.data(), src_count) == 0) {
+            same = src_count;
+        }
+        while(same < dst_count && buff[same] == existing[same]) {
+            same++;
+        }
+        if(verify) {
+            src_crc = Crc32cUpdate(src_crc, buff, same);
+        }
+        offset += same;
+        progress->done = offset;
+        if(src_count == 0 || same < src_count) {
+            break;
+        }
+    }
+    if(lseek(src_file_failed, offset, SEEK_SET) == FAIL || lseek(dst_file_failed, offset, SEEK_SET) == FAIL) {
+        perror("smash error: lseek failed");
+        return FAIL;
+    }
+    return offset;
+}
+
+// FICLONE for a whole file, FICLONERANGE from the block holding the first byte --resume has to redo
+bool CopyCommand::TryReflink(off_t offset, uint32_t &src_crc) {
+    struct stat dst_stat;
+    if (fstat(dst_file_failed, &dst_stat) == FAIL) {
+        return false;
+    }
+    if (offset == 0) {
+        if (ioctl(dst_file_failed, FICLONE, src_file_failed) == FAIL) {
+            return false;
+        }
+    }
+    else {
+        struct file_clone_range range;
+        range.src_fd = src_file_failed;
+        range.src_offset = offset - offset % dst_stat.st_blksize;
+        range.src_length = 0; // up to the end of the source
+        range.dest_offset = range.src_offset;
+        if (ioctl(dst_file_failed, FICLONERANGE, &range) == FAIL) {
+            return false;
+        }
+    }
+    // nothing streamed through us, so --verify has to read the source on its own
+    for (off_t position = offset; verify && position < src_size;) {
+        ssize_t r_value = pread(src_file_failed, buff, COPY_BLOCK, position);
+        if (r_value == FAIL && errno == EINTR) {
+            continue;
+        }
+        if (r_value <= 0) {
+            perror("smash error: read failed");
+            return false;
+        }
+        src_crc = Crc32cUpdate(src_crc, buff, r_value);
+        position += r_value;
+    }
+    progress->done = src_size;
+    return true;
+}
+
+bool CopyCommand::CopyRange(off_t from, off_t to, uint32_t &src_crc) {
+    while (from < to) {
+        ssize_t r_value = pread(src_file_failed, buff, min<off_t>(COPY_BLOCK, to - from), from);
+        if (r_value == FAIL && errno == EINTR) {
+            continue;
+        }
+        if (r_value == FAIL) {
+            perror("smash error: read failed");
+            return false;
+        }
+        if (r_value == 0) { // the source shrank under us
+            break;
+        }
+        if (verify) {
+            src_crc = Crc32cUpdate(src_crc, buff, r_value);
+        }
+        if (!PwriteFull(dst_file_failed, buff, r_value, from)) {
+            perror("smash error: write failed");
+            return false;
+        }
+        io_ops += 2;
+        copied += r_value;
+        from += r_value;
+        progress->done = from;
+    }
+    return true;
+}
+
+// a hole in the source stays a hole in the copy, only --resume can find old data there
+bool CopyCommand::SkipHole(off_t from, off_t to, uint32_t &src_crc) {
+    memset(buff, 0, COPY_BLOCK);
+    bool punched = !resume || fallocate(dst_file_failed, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from, to - from) == SUCC;
+    for (off_t position = from; position < to && (verify || !punched);) {
+        size_t count = min<off_t>(COPY_BLOCK, to - position);
+        if (verify) {
+            src_crc = Crc32cUpdate(src_crc, buff, count);
+        }
+        if (!punched && !PwriteFull(dst_file_failed, buff, count, position)) {
+            perror("smash error: write failed");
+            return false;
+        }
+        position += count;
+    }
+    progress->done = to;
+    return true;
+}
+
+// keeps uring_depth blocks in flight, each block is read into its registered buffer and written back out of it
+bool CopyCommand::UringCopyRange(IoUring &ring, off_t from, off_t to, uint32_t &src_crc) {
+    enum SlotState {Free, Reading, Writing, Written};
+    struct Slot {
+        SlotState state;
+        off_t offset;
+        size_t length;
+        size_t done;
+        bool checked;
+    };
+    // O_DIRECT wants aligned offsets and lengths, the unaligned edges go through the page cache
+    off_t aligned_from = direct ? min<off_t>(to, (from + COPY_DIRECT_ALIGN - 1) / COPY_DIRECT_ALIGN * COPY_DIRECT_ALIGN) : from;
+    off_t aligned_to = direct ? max<off_t>(aligned_from, to - to % COPY_DIRECT_ALIGN) : to;
+    if (!CopyRange(from, aligned_from, src_crc)) {
+        return false;
+    }
+    if (direct && (!SetDirectIo(src_file_failed, true) || !SetDirectIo(dst_file_failed, true))) {
+        perror("smash error: fcntl failed");
+        return false;
+    }
+    vector<Slot> slots(uring_depth, Slot{Free, 0, 0, 0, false});
+    off_t next = aligned_from;
+    off_t crc_offset = aligned_from;
+    unsigned in_flight = 0;
+    while (true) {
+        for (unsigned i = 0; i < uring_depth && next < aligned_to; i++) {
+            if (slots[i].state == Free) {
+                slots[i] = Slot{Reading, next, static_cast<size_t>(min<off_t>(COPY_BLOCK, aligned_to - next)), 0, false};
+                ring.QueueFixed(IORING_OP_READ_FIXED, src_file_failed, i, 0, slots[i].length, next);
+                next += slots[i].length;
+                in_flight++;
+            }
+        }
+        if (in_flight == 0) {
+            break;
+        }
+        if (!ring.Submit(1)) {
+            perror("smash error: io_uring_enter failed");
+            return false;
+        }
+        uint64_t index;
+        int result;
+        while (ring.Reap(index, result)) {
+            Slot &slot = slots[index];
+            in_flight--;
+            io_ops++;
+            if (result < 0) {
+                errno = -result;
+                perror(slot.state == Reading ? "smash error: read failed" : "smash error: write failed");
+                return false;
+            }
+            if (slot.state == Reading && result == 0) { // the source shrank under us
+                slot.length = slot.done;
+                aligned_to = min<off_t>(aligned_to, slot.offset + slot.done);
+                to = min(to, aligned_to);
+            }
+            slot.done += result;
+            if (slot.done < slot.length) { // a short transfer, queue the rest
+                ring.QueueFixed(slot.state == Reading ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED,
+                                slot.state == Reading ? src_file_failed : dst_file_failed,
+                                index, slot.done, slot.length - slot.done, slot.offset + slot.done);
+                in_flight++;
+            }
+            else if (slot.state == Reading) {
+                slot.state = Writing;
+                slot.done = 0;
+                ring.QueueFixed(IORING_OP_WRITE_FIXED, dst_file_failed, index, 0, slot.length, slot.offset);
+                in_flight++;
+            }
+            else {
+                slot.state = Written;
+                copied += slot.length;
+                progress->done += slot.length;
+            }
+        }
+        // the checksum has to see the blocks in file order, a buffer is reused only after that
+        for (bool advanced = verify; advanced;) {
+            advanced = false;
+            for (Slot &slot : slots) {
+                if ((slot.state == Writing || slot.state == Written) && !slot.checked && slot.offset == crc_offset) {
+                    src_crc = Crc32cUpdate(src_crc, ring.Buffer(&slot - slots.data()), slot.length);
+                    crc_offset += slot.length;
+                    slot.checked = advanced = true;
+                }
+            }
+        }
+        for (Slot &slot : slots) {
+            if (slot.state == Written && (slot.checked || !verify)) {
+                slot.state = Free;
+            }
+        }
+    }
+    if (direct && (!SetDirectIo(src_file_failed, false) || !SetDirectIo(dst_file_failed, false))) {
+        perror("smash error: fcntl failed");
+        return false;
+    }
+    return CopyRange(aligned_to, to, src_crc);
+}
+
+// reflink when the filesystem shares extents, otherwise only the data extents SEEK_DATA/SEEK_HOLE report
+bool CopyCommand::CopyFrom(off_t offset, uint32_t &src_crc) {
+    if (offset < src_size && TryReflink(offset, src_crc)) {
+        method = "reflink";
+    }
+    // --uring falls back to plain read/write when the kernel has no io_uring for us
+    IoUring ring;
+    bool use_ring = method != "reflink" && uring_depth > 0 && ring.Setup(uring_depth) &&
+                    ring.RegisterBuffers(uring_depth, COPY_BLOCK);
+    // not every filesystem takes O_DIRECT, those copy through the page cache
+    direct = use_ring && direct && SetDirectIo(src_file_failed, true) && SetDirectIo(src_file_failed, false) &&
+             SetDirectIo(dst_file_failed, true) && SetDirectIo(dst_file_failed, false);
+    bool sparse = false;
+    while (method != "reflink" && offset < src_size) {
+        off_t data = lseek(src_file_failed, offset, SEEK_DATA);
+        if (data == FAIL) { // ENXIO is a hole up to the end, anything else means no hole support
+            data = (errno == ENXIO) ? src_size : offset;
+        }
+        off_t hole = (data < src_size) ? lseek(src_file_failed, data, SEEK_HOLE) : src_size;
+        if (hole == FAIL || hole > src_size) {
+            hole = src_size;
+        }
+        if (data > offset) {
+            sparse = true;
+            if (!SkipHole(offset, data, src_crc)) {
+                return false;
+            }
+        }
+        if (!(use_ring ? UringCopyRange(ring, data, hole, src_crc) : CopyRange(data, hole, src_crc))) {
+            return false;
+        }
+        offset = hole;
+    }
+    if (method != "reflink") {
+        method = string(use_ring ? "io_uring depth " + to_string(uring_depth) : "read/write") +
+                 (direct ? " O_DIRECT" : "") + (sparse ? " sparse" : "");
+    }
+    // sets the size of a trailing hole and cuts whatever an old copy left past the end
+    if (ftruncate(dst_file_failed, src_size) == FAIL) {
+        perror("smash error: ftruncate failed");
+        return false;
+    }
+    return true;
+}
+
+// --verify: reads the copy back from the disk rather than from the page cache and compares checksums
+bool CopyCommand::VerifyDestination(uint32_t src_crc) {
+    if (fdatasync(dst_file_failed) == FAIL) {
+        perror("smash error: fdatasync failed");
+        return false;
+    }
+    posix_fadvise(dst_file_failed, 0, 0, POSIX_FADV_DONTNEED);
+    if (lseek(dst_file_failed, 0, SEEK_SET) == FAIL) {
+        perror("smash error: lseek failed");
+        return false;
+    }
+    off_t dst_size = 0;
+    uint32_t dst_crc = ~0u;
+    ssize_t r_value;
+    while ((r_value = ReadFull(dst_file_failed, buff, COPY_BLOCK)) > 0) {
+        dst_crc = Crc32cUpdate(dst_crc, buff, r_value);
+        dst_size += r_value;
+        progress->done = src_size + dst_size;
+    }
+    if (r_value == FAIL) {
+        perror("smash error: read failed");
+        return false;
+    }
+    if (dst_crc != src_crc || dst_size != src_size) {
+        cout << "smash error: cp: verification failed" << endl;
+        return false;
+    }
+    checksum = ~dst_crc;
+    return true;
+}
+
 void CopyCommand::execute() {
-    if((num_of_args < 3) || ((num_of_args == 3) && (args.at(2).compare("&") == 0))) {
+    if(!valid_args) {
         cout << "smash error: cp: invalid arguments" << endl;
         return;
     }
@@ -1039,40 +6028,78 @@ void CopyCommand::execute() {
         perror("smash error: open failed");
         return;
     }
+    struct stat src_stat;
+    if(fstat(src_file_failed, &src_stat) == FAIL) {
+        perror("smash error: fstat failed");
+        return;
+    }
+    void *shared = mmap(NULL, sizeof(CopyProgress), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(shared == MAP_FAILED) {
+        perror("smash error: mmap failed");
+        return;
+    }
+    progress = new (shared) CopyProgress();
+    src_size = src_stat.st_size;
+    progress->total = src_size * (verify ? 2 : 1);
 
 
+    placement = GlobalSmash().TakePlacement(is_background);
+    limits = GlobalSmash().TakeLimits();
     pid_t copy_pid = fork();
+    if(copy_pid < 0) {
+        perror("smash error: fork failed");
+        return;
+    }
     if(copy_pid > 0) {
+        setpgid(copy_pid, copy_pid); // both sides set it, whichever runs first wins the race
         if(is_background) {
-            global_smash.GetJobsList()->AddJob(this, copy_pid, Background);
+            GlobalSmash().GetJobsList()->AddJob(this, copy_pid, Background);
         }
         else {
             JobsList::JobEntry *fore_ground_job = new JobsList::JobEntry(FAIL, Foreground, this, copy_pid);
-            global_smash.SetForeGroundJob(fore_ground_job);
-            if (waitpid(copy_pid, NULL, WUNTRACED) == FAIL) {
-                perror("smash error: waitpid failed");
-            }
-            if (!global_smash.GetJobsList()->JobPidExists(copy_pid)) {
+            GlobalSmash().SetForeGroundJob(fore_ground_job);
+            GlobalSmash().WaitForegroundJob(fore_ground_job);
+            if (!GlobalSmash().GetJobsList()->JobPidExists(copy_pid)) {
+                limits.Release();
                 delete fore_ground_job;
             }
-            global_smash.SetForeGroundJob(nullptr);
+            GlobalSmash().SetForeGroundJob(nullptr);
         }
     }
     if(copy_pid == 0) {
-        setpgrp();
-        ssize_t r_value;
-        do {
-            r_value = read(src_file_failed, buff, READBLOCK);
-            if (r_value == FAIL) {
-                perror("smash error: read failed");
-                return;
-            }
-            if (write(dst_file_failed, buff, r_value) == FAIL) {
-                perror("smash error: write failed");
-                return;
-            }
-        } while (r_value != 0);
-        cout << "smash: " + src_file + " was copied to " + dst_file << endl;
+        setpgid(0, 0);
+        signal(SIGINT, SIG_DFL); // it never execs, the terminal's signals must not run smash's handlers
+        signal(SIGTSTP, SIG_DFL);
+        if (!is_background) {
+            GlobalSmash().ClaimTerminal();
+        }
+        placement.Apply();
+        limits.Apply();
+        uint32_t src_crc = ~0u;
+        off_t offset = resume ? SkipMatchingPrefix(src_crc) : 0;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (offset == FAIL || !CopyFrom(offset, src_crc)) {
+            exit(1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (verify && !VerifyDestination(src_crc)) {
+            exit(1);
+        }
+        double seconds = max(1e-9, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+        ostringstream details;
+        details << method;
+        if (copied > 0) {
+            details << ", " << fixed << setprecision(1) << copied / seconds / (1 << 20) << " MiB/s, "
+                    << setprecision(0) << io_ops / seconds << " IOPS";
+        }
+        if (resume) {
+            details << ", resumed at byte " << offset;
+        }
+        if (verify) {
+            details << ", crc32c " << hex << setw(8) << setfill('0') << checksum << " verified";
+        }
+        cout << "smash: " + src_file + " was copied to " + dst_file << " (" << details.str() << ")" << endl;
         exit(0);
     }
 }
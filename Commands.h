@@ -6,7 +6,14 @@
 #include <vector>
 #include <array>
 #include <list>
+#include <map>
+#include <atomic>
+#include <unordered_map>
+#include <set>
 #include <string.h>
+#include <sched.h>
+#include <string>
+#include <iostream>
 using namespace std;
 
 #define COMMAND_ARGS_MAX_LENGTH (200)
@@ -15,42 +22,268 @@ using namespace std;
 #define COMMAND_MAX_LENGTH (80)
 #define READBLOCK (4096)
 #define FAIL -1
+#define NANOS_PER_SECOND (1000000000LL)
 #define SUCC 0
 #define FIND_FAIL (string::npos)
+#define NUMA_MAX_NODES (1024)
+#define NUMA_NODE_PATH "/sys/devices/system/node/node"
+#define CGROUP_CPU_PERIOD (100000)
+#define CGROUP_CONTROLLERS "+memory +cpu +pids"
+#define SPLICE_BLOCK (1 << 20)
+#define JOB_TABLE_SIZE (256)
+#define JOBS_RETAINED_STATUSES (64)
+#define SHELL_SYNTAX_CHARS "`;&|<>(){}!#\n"
+#define ZYGOTE_MAX_REQUEST (1 << 17)
+#define ZYGOTE_PASSED_FDS (4)
+#define CAPTURE_INITIAL_SIZE (4096)
+#define COMPLETION_MAX_LISTED (100)
+#define DIRECTORY_CACHED_LISTINGS (64)
+#define REMOTE_MAX_CLIENTS (16)
+#define REMOTE_MAX_FRAME (1 << 20)
+#define COPY_BLOCK (1 << 17)
+#define COPY_URING_DEPTH (8)
+#define COPY_URING_MAX_DEPTH (64)
+#define COPY_DIRECT_ALIGN (4096)
+#define JOB_OUTPUT_CAPACITY (1 << 16)
 
 enum JobState {Foreground,Background,Stopped};
+enum CpuPolicy {NoPolicy,RoundRobin};
+enum ScriptFlow {FlowNext,FlowBreak,FlowContinue,FlowAbort};
+
+// one piece of a word as written: literal text, a $NAME or $? reference, a $(...) command or a leading ~
+struct WordPart {
+    enum Kind {Literal,Variable,Substitution,Home};
+    Kind kind;
+    string text; // the characters, the variable name or the command inside $(...)
+    bool quoted;
+};
+typedef vector<WordPart> LexedWord;
+struct CompiledCommand;
 
 bool IsStringNumber(const string &str);
+bool ParseSize(const string &str, long long *bytes);
+int ParseCommandLine(string cmd_line, vector<string> &args);
+size_t SkipWords(const string &line, int count);
+bool IsBackgroundCommand(string cmd_line);
+void RemoveBackgroundSign(char* cmd_line);
+string RemoveBackgroundSign(string str);
+bool IsTimeoutCommand(const char *cmd_line);
+void RemoveTimeoutSign(char *cmd_line);
+string GetFirstStringInCmdLine(const char *cmd_line);
+bool IsRedirectionCommand(const char* cmd_line);
+bool IsInputRedirectionCommand(const char* cmd_line);
+bool IsPipeCommand(const char* cmd_line);
+size_t FindUnquoted(const string &line, const string &chars, size_t pos = 0);
+bool LexWords(const string &line, vector<LexedWord> &words, string *error);
+string JsonString(const string &str);
+int StatusFromWait(int wait_status);
+long long MonotonicNanos(); // async-signal-safe
+
+class JobPlacement {
+    cpu_set_t cpus;
+    bool has_cpus;
+    int numa_node;
+public:
+    JobPlacement();
+    static bool ParseCpuList(const string &list, cpu_set_t *set);
+    static string CpuListString(const cpu_set_t *set);
+    void SetCpus(const cpu_set_t &set);
+    void SetNumaNode(int node);
+    void Merge(const JobPlacement &other);
+    void Apply() const; // called in the child, before exec
+    string Describe() const;
+    bool IsEmpty() const {
+        return !has_cpus && numa_node == -1;
+    };
+    bool HasCpus() const {
+        return has_cpus;
+    };
+};
+
+class JobLimits {
+    long long mem_bytes;
+    int cpu_percent;
+    long long max_pids;
+    string cgroup_path;
+public:
+    JobLimits();
+    bool ParseOption(const string &option, const string &value);
+    void Merge(const JobLimits &other);
+    void Prepare(); // called in smash before fork, creates the job's cgroup leaf
+    void Apply() const; // called in the child, before exec
+    void Release(); // called in smash once the job was reaped
+    string Describe() const;
+    string Usage() const;
+    bool IsEmpty() const {
+        return mem_bytes == -1 && cpu_percent == -1 && max_pids == -1;
+    };
+    bool HasPids() const {
+        return max_pids != -1;
+    };
+};
+
+class GlobPattern {
+    enum TokenType {Literal, AnyChar, AnyString, CharClass};
+    struct Token {
+        TokenType type;
+        char literal;
+        vector<pair<char, char> > ranges;
+        bool negated;
+    };
+    vector<Token> tokens;
+    static bool TokenMatches(const Token &token, char c);
+public:
+    explicit GlobPattern(const string &pattern);
+    bool Matches(const string &name) const;
+    static bool HasMagic(const string &word);
+};
+
+struct DirEntry {
+    string name;
+    bool is_dir;
+    bool is_link;
+};
+
+// The logical cwd, kept up to date by cd, and recently listed directories.
+// A listing stays cached until inotify reports a change in that directory.
+class DirectoryState {
+    string cwd;
+    int inotify_fd;
+    map<string, int> watched;
+    map<int, string> watched_dirs;
+    map<string, vector<DirEntry> > listings;
+    map<string, struct timespec> unwatched; // listings kept without a watch, valid while the mtime is unchanged
+    list<string> recent; // most recently listed first
+    vector<DirEntry> uncached;
+    void ReadEvents();
+    void Forget(const string &dir);
+    bool IsStale(const string &dir) const;
+public:
+    DirectoryState();
+    ~DirectoryState();
+    const string& GetCwd() const {
+        return cwd;
+    };
+    string Resolve(const string &path) const;
+    bool ChangeDir(const string &path);
+    const vector<DirEntry>* List(const string &dir);
+};
+
+class GlobExpander {
+    const vector<DirEntry>* ListDir(const string &dir);
+    void ExpandSegments(const string &prefix, const vector<string> &segments, size_t index, vector<string> &results);
+public:
+    vector<string> Expand(const string &word);
+};
+
+class CompletionTrie {
+    struct Node {
+        map<char, int> children;
+        int count; // how many sources hold the word ending here
+    };
+    vector<Node> nodes;
+    void CollectFrom(int node, string &word, vector<string> &matches) const;
+public:
+    CompletionTrie();
+    void Insert(const string &word);
+    void Remove(const string &word);
+    void Collect(const string &prefix, vector<string> &matches) const;
+};
+
+// Completion candidates for the line editor, kept current by inotify events instead of rescans.
+class CompletionIndex {
+    struct WatchedDir { // a $PATH directory
+        string path;
+        set<string> executables;
+    };
+    int inotify_fd;
+    string path_value;
+    CompletionTrie commands;
+    map<int, WatchedDir> watches;
+    int Watch(const string &dir);
+    void Unwatch(int wd);
+    void UpdateEntry(WatchedDir &dir, const string &name, bool exists, bool is_dir);
+    void ScanDir(WatchedDir &dir);
+    void RefreshPath();
+    void ReadEvents();
+public:
+    CompletionIndex();
+    ~CompletionIndex();
+    void Complete(const string &word, bool is_command, vector<string> &matches);
+};
+
+class LineEditor {
+    vector<string> history;
+    string buffer;
+    size_t cursor;
+    CompletionIndex completion;
+    void Redraw(const string &prompt);
+    void Insert(const string &text);
+    bool SearchHistory(const string &prompt);
+    void Complete(const string &prompt);
+    void ShowHistory(size_t index, string &draft, size_t &history_pos);
+public:
+    LineEditor() : cursor(0) {};
+    bool ReadLine(const string &prompt, string &line);
+    void AddHistory(const string &line);
+};
 
 class Command {
  protected:
   vector<string> args;
   int num_of_args;
   const char* cmd_line;
+  bool expansion_failed; // args could not be expanded, the command must not run
+  bool args_expanded; // args came expanded from a compiled command line
  public:
   Command(const char* cmd_line);
   virtual ~Command();
   virtual void execute() = 0;
+  // percentage of the work done, -1 for commands that do not report one
+  virtual int Progress() {
+      return FAIL;
+  }
   const char* GetCmdLine() {
       return cmd_line;
   }
 
+  bool ExpansionFailed() {
+      return expansion_failed;
+  }
+
   vector<string>* GetArgs() {
       return &args;
   }
+
+  JobPlacement* GetPlacement() {
+      return &placement;
+  }
+
+  JobLimits* GetLimits() {
+      return &limits;
+  }
+ protected:
+  JobPlacement placement;
+  JobLimits limits;
 };
 
 class BuiltInCommand : public Command {
+ protected:
+  ostream* out;
  public:
   BuiltInCommand(const char* cmd_line);
   virtual ~BuiltInCommand() {}
     bool IsStringInCmdLine(string s);
+    void SetOutput(ostream* stream) {
+        out = stream;
+    }
 };
 
 class ExternalCommand : public Command {
     bool is_piped;
+    vector<string> words; // the expanded argv, bash -c for lines with shell syntax
  public:
-  ExternalCommand(const char* cmd_line, bool isPiped) : Command(cmd_line), is_piped(isPiped) {};
+  ExternalCommand(const char* cmd_line, bool isPiped);
   virtual ~ExternalCommand() {}
   void execute() override;
 };
@@ -60,21 +293,69 @@ class PipeCommand : public Command {
   string first;
   string second;
   bool background;
+  long long pipe_size;
+  const CompiledCommand* compiled; // the stages, lexed once, for a pipeline in a script
+  void ExecuteStage(bool is_first);
  public:
   PipeCommand(const char* cmd_line);
+  PipeCommand(const char* cmd_line, const CompiledCommand* compiled);
   virtual ~PipeCommand() {}
   void execute() override;
+  bool ExecuteInProcessProducer(int fd[2]);
+  const string& GetSign() const {
+      return sign;
+  }
+  const string& GetFirst() const {
+      return first;
+  }
+  const string& GetSecond() const {
+      return second;
+  }
+  bool IsBackground() const {
+      return background;
+  }
 };
 
 class RedirectionCommand : public Command {
     string new_cmd_line;
     string file_name;
     string sign;
+    const CompiledCommand* compiled; // the command and the lexed target, for a redirection in a script
  public:
   explicit RedirectionCommand(const char* cmd_line);
+  RedirectionCommand(const char* cmd_line, const CompiledCommand* compiled);
   virtual ~RedirectionCommand() {}
   void execute() override;
+  const string& GetSign() const {
+      return sign;
+  }
+  const string& GetNewCmdLine() const {
+      return new_cmd_line;
+  }
+  const string& GetFileName() const {
+      return file_name;
+  }
+};
 
+class InputRedirectionCommand : public Command {
+    string new_cmd_line;
+    string file_name;
+    bool is_here_doc;
+    const CompiledCommand* compiled; // the command and the lexed target, for a redirection in a script
+public:
+    explicit InputRedirectionCommand(const char* cmd_line);
+    InputRedirectionCommand(const char* cmd_line, const CompiledCommand* compiled);
+    virtual ~InputRedirectionCommand() {}
+    void execute() override;
+    bool IsHereDoc() const {
+        return is_here_doc;
+    }
+    const string& GetNewCmdLine() const {
+        return new_cmd_line;
+    }
+    const string& GetFileName() const {
+        return file_name;
+    }
 };
 
 class LsCommand: public BuiltInCommand {
@@ -120,14 +401,18 @@ class JobsList {
   class JobEntry {
       int job_id;
       JobState job_state;
-      time_t add_time;
+      long long start_ns;
+      long long stopped_ns; // stopped time so far, left out of the elapsed time
+      long long stopped_since; // when the current stop began, 0 while not stopped
       Command* cmd;
       pid_t pid;
       bool time_out;
-      time_t time_stamp;
       int duration;
+      int exit_status;
+      bool timeout_released;
   public:
       JobEntry(int id, JobState state, Command* cmd, pid_t pid, bool time_out = false);
+      ~JobEntry();
       JobState GetState() const {
           return this->job_state;
       };
@@ -140,22 +425,14 @@ class JobsList {
           return this->pid;
       };
 
-      time_t GetTimeThatAdded() const {
-          return this->add_time;
+      long long GetElapsedNanos(long long now) const {
+          return now - start_ns - stopped_ns - (stopped_since != 0 ? now - stopped_since : 0);
       };
 
       Command* GetCommand() {
           return cmd;
       };
 
-      time_t GetTimeStamp() const {
-          return this->time_stamp;
-      };
-
-      time_t GetDifferentTime() const {
-          return difftime(time_stamp + duration, time(nullptr));
-      };
-
       int GetDuration() const {
           return this->duration;
       };
@@ -169,32 +446,55 @@ class JobsList {
       };
 
       void SetState(JobState job_state){
+          if ((job_state == Stopped) != (stopped_since != 0)) {
+              long long now = MonotonicNanos();
+              stopped_ns += (stopped_since != 0) ? now - stopped_since : 0;
+              stopped_since = (job_state == Stopped) ? now : 0;
+          }
           this->job_state = job_state;
       };
 
       void ResetTimeAdded() {
-          this->add_time = time(NULL);
+          start_ns = MonotonicNanos();
+          stopped_ns = 0;
+          stopped_since = (job_state == Stopped) ? start_ns : 0;
       };
 
+      int GetExitStatus() const {
+          return this->exit_status;
+      };
+
+      void SetExitStatus(int exit_status) {
+          this->exit_status = exit_status;
+      };
+
+      void ReleaseTimeout();
+
   };
     list<JobEntry*> jobs_list;
+    list<JobEntry*> finished_jobs; // reaped background jobs, kept for wait
+    void ForgetFinishedJob(int job_id);
  public:
   JobsList();
   ~JobsList();
-  void AddJob(Command* cmd, pid_t pid, JobState state, bool is_timeout = false);
+  JobEntry* AddJob(Command* cmd, pid_t pid, JobState state, bool is_timeout = false);
   void AddJob(JobEntry* job, JobState state, bool give_job_id = false);
   JobEntry* RemoveJobByJobId(int job_id);
   JobEntry* RemoveJobByPid(pid_t pid);
-  void PrintJobsList();
+  void PrintJobsList(bool verbose = false, ostream &out = cout);
+  void PrintJobRecords(ostream &out);
   void KillAllJobs();
   void RemoveFinishedJobs();
+  void MarkFinished(pid_t pid, int exit_status, const struct rusage *usage = nullptr);
+  void EmitEvent(const char* event, JobEntry* job, int status = -1, const struct rusage *usage = nullptr);
+  void PrintJobsJson(ostream &out);
+  JobEntry *TakeFinishedJob(int job_id);
+  vector<int> GetRunningJobIds();
   JobEntry *GetJobById(int job_id);
   JobEntry *GetLastJob(int* last_job_id);
   JobEntry *GetLastStoppedJob(int* job_id);
-  JobsList::JobEntry* GetTimeoutJobToKill();
   int GetMaxJobId();
   int GetMaxStoppedJobId();
-  int GetClosestTimeout();
   pid_t GetJobPidByJobId(int id);
   int GetSize();
   bool JobIdExists(int jobId);
@@ -202,8 +502,6 @@ class JobsList {
   bool IsEmpty();
 };
 
-bool JobsCmpClosestTime(const JobsList::JobEntry *j1, const JobsList::JobEntry *j2);
-
 class JobsCommand : public BuiltInCommand {
  public:
   JobsCommand(const char* cmd_line) : BuiltInCommand(cmd_line){};
@@ -218,6 +516,27 @@ class KillCommand : public BuiltInCommand {
   void execute() override;
 };
 
+class ExportCommand : public BuiltInCommand {
+ public:
+  ExportCommand(const char* cmd_line) : BuiltInCommand(cmd_line){};
+  virtual ~ExportCommand() {}
+  void execute() override;
+};
+
+class UnsetCommand : public BuiltInCommand {
+ public:
+  UnsetCommand(const char* cmd_line) : BuiltInCommand(cmd_line){};
+  virtual ~UnsetCommand() {}
+  void execute() override;
+};
+
+class WaitCommand : public BuiltInCommand {
+ public:
+  WaitCommand(const char* cmd_line) : BuiltInCommand(cmd_line){};
+  virtual ~WaitCommand() {}
+  void execute() override;
+};
+
 class ForegroundCommand : public BuiltInCommand {
  public:
   ForegroundCommand(const char* cmd_line) : BuiltInCommand(cmd_line){};
@@ -240,6 +559,90 @@ public:
     void execute() override;
 };
 
+class CpusetCommand : public Command {
+    string new_cmd_line;
+    bool is_piped; // passed on to the prefixed command
+    bool is_timeout;
+    bool valid;
+    JobPlacement prefix_placement;
+public:
+    CpusetCommand(const char* cmd_line, bool isPiped, bool isTimeout);
+    virtual ~CpusetCommand(){};
+    void execute() override;
+};
+
+class NumaCommand : public Command {
+    string new_cmd_line;
+    bool is_piped; // passed on to the prefixed command
+    bool is_timeout;
+    bool valid;
+    int node;
+    cpu_set_t node_cpus;
+    bool has_node_cpus;
+public:
+    NumaCommand(const char* cmd_line, bool isPiped, bool isTimeout);
+    virtual ~NumaCommand(){};
+    void execute() override;
+};
+
+class LimitCommand : public Command {
+    string new_cmd_line;
+    bool is_piped; // passed on to the prefixed command
+    bool is_timeout;
+    bool valid;
+    JobLimits prefix_limits;
+public:
+    LimitCommand(const char* cmd_line, bool isPiped, bool isTimeout);
+    virtual ~LimitCommand(){};
+    void execute() override;
+};
+
+class CoprocCommand : public Command {
+    string name;
+    string new_cmd_line;
+public:
+    CoprocCommand(const char* cmd_line);
+    virtual ~CoprocCommand(){};
+    void execute() override;
+};
+
+class SendCommand : public BuiltInCommand {
+public:
+    SendCommand(const char* cmd_line) : BuiltInCommand(cmd_line){};
+    virtual ~SendCommand(){};
+    void execute() override;
+};
+
+class RecvCommand : public BuiltInCommand {
+public:
+    RecvCommand(const char* cmd_line) : BuiltInCommand(cmd_line){};
+    virtual ~RecvCommand(){};
+    void execute() override;
+};
+
+class PipeSizeCommand : public BuiltInCommand {
+public:
+    PipeSizeCommand(const char* cmd_line) : BuiltInCommand(cmd_line){};
+    virtual ~PipeSizeCommand(){};
+    void execute() override;
+};
+
+class PassthruCommand : public BuiltInCommand {
+    void Passthru();
+    void CopyWithReadWrite(int file_fd);
+public:
+    PassthruCommand(const char* cmd_line) : BuiltInCommand(cmd_line){};
+    virtual ~PassthruCommand(){};
+    void execute() override;
+};
+
+class CpuPolicyCommand : public BuiltInCommand {
+public:
+    CpuPolicyCommand(const char* cmd_line) : BuiltInCommand(cmd_line){};
+    virtual ~CpuPolicyCommand(){};
+    void execute() override;
+};
+
 class TimeoutCommand : public Command{
     int duration;
     string new_cmd_line;
@@ -249,8 +652,51 @@ public:
     void execute() override;
 };
 
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// a bare io_uring through the raw syscalls, with its own registered buffers
+class IoUring {
+    int ring_fd = FAIL;
+    unsigned entries = 0;
+    void* sq_ring = nullptr;
+    void* cq_ring = nullptr;
+    size_t sq_ring_size = 0;
+    size_t cq_ring_size = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqes_size = 0;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_cqe* cqes = nullptr;
+    unsigned to_submit = 0;
+    char* buffers = nullptr;
+    size_t buffers_size = 0;
+    size_t buffer_size = 0;
+public:
+    IoUring() = default;
+    IoUring(IoUring const&) = delete;
+    void operator=(IoUring const&) = delete;
+    ~IoUring();
+    bool Setup(unsigned entries);
+    bool RegisterBuffers(unsigned count, size_t size);
+    char* Buffer(unsigned index) {
+        return buffers + index * buffer_size;
+    }
+    bool QueueFixed(uint8_t opcode, int fd, unsigned buf_index, size_t skip, unsigned length, off_t offset);
+    bool Submit(unsigned wait_for);
+    bool Reap(uint64_t &user_data, int &result);
+};
+
 class CopyCommand : public BuiltInCommand {
+    // lives in a shared mapping so jobs can read how far the copying child got
+    struct CopyProgress {
+        atomic<long long> done;
+        atomic<long long> total;
+    };
+    bool valid_args = false;
     bool is_background;
+    bool resume = false;
+    bool verify = false;
     string src_file = "";
     string dst_file = "";
     char* src_file_full = NULL;
@@ -258,22 +704,361 @@ class CopyCommand : public BuiltInCommand {
     int src_file_failed = -1;
     int dst_file_failed = -1;
     char* buff = NULL;
+    CopyProgress* progress = nullptr;
+    uint32_t checksum = 0;
+    off_t src_size = 0;
+    string method = "read/write";
+    unsigned uring_depth = 0;
+    bool direct = false;
+    long long copied = 0;
+    long long io_ops = 0;
+    off_t SkipMatchingPrefix(uint32_t &src_crc);
+    bool TryReflink(off_t offset, uint32_t &src_crc);
+    bool CopyRange(off_t from, off_t to, uint32_t &src_crc);
+    bool SkipHole(off_t from, off_t to, uint32_t &src_crc);
+    bool UringCopyRange(IoUring &ring, off_t from, off_t to, uint32_t &src_crc);
+    bool CopyFrom(off_t offset, uint32_t &src_crc);
+    bool VerifyDestination(uint32_t src_crc);
 public:
     CopyCommand(const char* cmd_line);
     virtual ~CopyCommand();
     void execute() override;
+    int Progress() override;
+};
+
+// Job state shared with the signal handlers. Every slot is claimed through an atomic state,
+// so the handlers never touch JobsList and never allocate; the main loop does the bookkeeping.
+class JobStateTable {
+    enum SlotState {Free, Claimed, Armed, Fired};
+    struct Slot {
+        atomic<int> state;
+        pid_t pid;
+        const char* cmd_line;
+        long long deadline_ns; // CLOCK_MONOTONIC
+    };
+    Slot slots[JOB_TABLE_SIZE];
+    atomic<pid_t> fore_ground_pid;
+    atomic<bool> interrupted;
+public:
+    JobStateTable();
+    void NoteInterrupt(); // async-signal-safe
+    bool TakeInterrupt();
+    bool Register(pid_t pid, const char* cmd_line, long long deadline_ns);
+    void Release(pid_t pid);
+    void SetForeground(pid_t pid);
+    pid_t GetForeground() const; // async-signal-safe
+    bool PopExpired(pid_t* pid, const char** cmd_line); // async-signal-safe
+    long long NanosToClosestDeadline(long long now) const; // async-signal-safe
+    void ArmAlarm(long long limit_ns = FAIL) const; // async-signal-safe
+};
+
+class Environment {
+    unordered_map<string, string> variables;
+    unordered_map<string, string> locals; // shell variables that are not exported, like for loop variables
+    vector<string> env_strings;
+    vector<char*> envp; // cached for exec, rebuilt only after a change
+    bool envp_dirty;
+public:
+    Environment();
+    static bool IsValidName(const string &name);
+    static bool ParseVariable(const string &line, size_t &pos, string* name);
+    void Set(const string &name, const string &value);
+    void SetLocal(const string &name, const string &value);
+    void Unset(const string &name);
+    bool Get(const string &name, string* value) const;
+    char** GetEnvp();
+    bool ExpandVariable(const string &line, size_t &pos, int last_status, string* value) const;
+    string Expand(const string &line, int last_status) const; // here-document bodies, no quoting
+    void Print(ostream &out) const;
+};
+
+// A command line split once the way CreateCommand splits it: redirections and pipelines into their parts, other
+// commands into lexed words. Running it only expands the words. Commands that re-read their own text (timeout,
+// cpuset, numa, limit, coproc, send, pipesize pipelines and here-documents) stay Text and go to CreateCommand.
+struct CompiledCommand {
+    enum Kind {Text,Simple,Shell,InputRedirect,Redirect,Pipe};
+    Kind kind;
+    string line; // the text the command is created with, jobs show it
+    bool is_special; // Text: skip the redirection checks, as ExecuteCommand does
+    string name; // Simple and Shell: the first word, it picks the command
+    string source; // Shell: the line for bash -c, redirections: the target as written
+    string sign; // Redirect and Pipe
+    bool background; // Pipe
+    vector<LexedWord> words; // Simple: the arguments, redirections: the target
+    CompiledCommand* first; // redirections: the redirected command, Pipe: the stage before the sign
+    CompiledCommand* second; // Pipe: the stage after the sign
+    CompiledCommand(Kind kind, const string &line, bool is_special = false) : kind(kind), line(line),
+    is_special(is_special), background(false), first(nullptr), second(nullptr) {};
+    CompiledCommand(CompiledCommand const&) = delete;
+    void operator=(CompiledCommand const&) = delete;
+    ~CompiledCommand() {
+        delete first;
+        delete second;
+    };
+    static CompiledCommand* Compile(const string &line, bool is_special = false);
+};
+
+// Control flow and command lines are compiled once into this tree; running it only expands words and executes.
+class ScriptNode {
+public:
+    virtual ~ScriptNode() {}
+    virtual ScriptFlow Run() = 0;
+};
+
+class ScriptBlock : public ScriptNode {
+    vector<ScriptNode*> nodes;
+public:
+    virtual ~ScriptBlock();
+    void Add(ScriptNode* node);
+    ScriptFlow Run() override;
+};
+
+class ScriptCommandNode : public ScriptNode {
+    CompiledCommand* command;
+public:
+    explicit ScriptCommandNode(const string &line) : command(CompiledCommand::Compile(line)) {};
+    virtual ~ScriptCommandNode() {
+        delete command;
+    };
+    ScriptFlow Run() override;
+};
+
+class ScriptJumpNode : public ScriptNode {
+    ScriptFlow flow;
+public:
+    explicit ScriptJumpNode(ScriptFlow flow) : flow(flow) {};
+    ScriptFlow Run() override {
+        return flow;
+    };
+};
+
+class ScriptIfNode : public ScriptNode {
+    vector<pair<CompiledCommand*, ScriptBlock*> > branches;
+    ScriptBlock* else_block;
+public:
+    ScriptIfNode() : else_block(nullptr) {};
+    virtual ~ScriptIfNode();
+    ScriptBlock* AddBranch(const string &condition);
+    ScriptBlock* AddElse();
+    bool HasElse() const {
+        return else_block != nullptr;
+    };
+    ScriptFlow Run() override;
+};
+
+class ScriptWhileNode : public ScriptNode {
+    CompiledCommand* condition;
+    ScriptBlock body;
+public:
+    explicit ScriptWhileNode(const string &condition) : condition(CompiledCommand::Compile(condition)) {};
+    virtual ~ScriptWhileNode() {
+        delete condition;
+    };
+    ScriptBlock* GetBody() {
+        return &body;
+    };
+    ScriptFlow Run() override;
+};
+
+class ScriptForNode : public ScriptNode {
+    string variable;
+    string words;
+    vector<LexedWord> lexed_words;
+    bool lexed; // false after a syntax error, Run reports it
+    ScriptBlock body;
+public:
+    ScriptForNode(const string &variable, const string &words);
+    ScriptBlock* GetBody() {
+        return &body;
+    };
+    ScriptFlow Run() override;
+};
+
+class ScriptCompiler {
+    struct Frame {
+        string keyword;
+        ScriptNode* node;
+        ScriptBlock* block;
+    };
+    vector<Frame> frames;
+    ScriptBlock* root;
+    bool FeedStatement(const string &statement);
+    bool InLoop() const;
+public:
+    ScriptCompiler() : root(nullptr) {};
+    ~ScriptCompiler();
+    bool Feed(const string &line);
+    bool IsOpen() const {
+        return !frames.empty();
+    };
+    void Reset();
+};
+
+// A helper forked at startup that launches external commands from its small address space.
+// The children are cloned with CLONE_PARENT, so they are still smash's children.
+class Zygote {
+    pid_t pid;
+    int sock;
+    static void Serve(int sock);
+    static void LaunchChild(char* payload, size_t size, int fds[ZYGOTE_PASSED_FDS]);
+public:
+    Zygote() : pid(-1), sock(-1) {};
+    bool Start();
+    void Stop();
+    bool IsRunning() const {
+        return sock != -1;
+    };
+    pid_t GetPid() const {
+        return pid;
+    };
+    pid_t Launch(const char* cmd_line, const vector<string> &words, char** envp, bool foreground);
+};
+
+// collects a <<WORD body from the following input lines
+class HereDocument {
+    string cmd_line;
+    string delimiter;
+    string body;
+    bool strip_tabs;
+    bool expand;
+public:
+    HereDocument() : strip_tabs(false), expand(false) {};
+    bool Start(const string &line);
+    bool AddLine(const string &line);
+    bool IsOpen() const {
+        return !delimiter.empty();
+    };
+    int Seal(const Environment &environment, int last_status);
+    string GetCmdLine() const {
+        return cmd_line;
+    };
+    void Reset();
+};
+
+// Requests and responses are frames of a 32 bit big endian length and a payload.
+// Request payload: an op ('C' command, 'J' jobs, 'K' "<job-id> <signal>", 'W' job ids, 'F' follow) and its argument.
+// After 'F' the connection also gets an 'E' frame for every job event.
+// Response payload: the op, a 32 bit big endian status and the captured output.
+// quit gets no response, the connection just closes.
+struct pollfd;
+
+class RemoteServer {
+    struct Client {
+        int fd;
+        string input;
+        string output;
+        bool following;
+    };
+    int listen_fd;
+    string path;
+    pid_t owner;
+    vector<Client> clients;
+    void HandleFrame(Client &client, const string &frame);
+    bool Flush(Client &client, bool block);
+public:
+    RemoteServer() : listen_fd(-1), owner(-1) {};
+    ~RemoteServer();
+    bool Start(const string &socket_path);
+    void Stop();
+    bool IsRunning() const {
+        return listen_fd != -1;
+    };
+    void AddPollFds(vector<struct pollfd> &fds) const;
+    void Service();
+    void Publish(const string &event);
+    bool HasFollowers() const;
+    static int RunClient(const string &socket_path, const vector<string> &requests);
+};
+
+class CoprocEntry {
+    string name;
+    pid_t pid;
+    int write_fd;
+    int read_fd;
+    string input;
+    string output;
+public:
+    CoprocEntry(const string &name, pid_t pid, int write_fd, int read_fd);
+    ~CoprocEntry();
+    void Service(); // nonblocking: drain the coprocess output and flush queued input
+    bool Send(const string &data);
+    string Receive();
+    bool IsFinished(JobsList* jobs_list) const;
+    pid_t GetPid() const {
+        return pid;
+    };
+    int GetReadFd() const {
+        return read_fd;
+    };
+    int GetWriteFd() const {
+        return input.empty() ? FAIL : write_fd;
+    };
+};
+
+// stdout/stderr of a background job, drained by the main loop into a bounded ring.
+// A full ring stops the reads, so the job blocks on its pipe instead of smash falling behind.
+class JobOutput {
+    int read_fd;
+    int job_id;
+    pid_t pid;
+    vector<char> ring;
+    size_t start;
+    size_t size;
+public:
+    JobOutput(int read_fd, int job_id, pid_t pid);
+    ~JobOutput();
+    void Service(); // nonblocking
+    string Take();
+    int GetPollFd() const {
+        return (size < ring.size()) ? read_fd : FAIL;
+    };
+    int GetJobId() const {
+        return job_id;
+    };
+    pid_t GetPid() const {
+        return pid;
+    };
+    bool IsDone() const { // the job closed its end and everything was taken
+        return read_fd == FAIL && size == 0;
+    };
 };
 
 class SmallShell {
  private:
     string prompt;
     char* last_dir;
+    JobStateTable job_table;
     JobsList jobs_list;
     JobsList::JobEntry* fore_ground_job;
     const pid_t smash_pid;
+    JobPlacement pending_placement;
+    CpuPolicy cpu_policy;
+    int next_rr_cpu;
+    JobLimits pending_limits;
+    string cgroup_root;
+    bool cgroup_checked;
+    map<string, CoprocEntry*> coprocs;
+    long long pipe_size;
+    GlobExpander glob_expander;
+    bool job_control;
+    int last_status;
+    Environment* environment; // built on first use
+    ScriptCompiler script_compiler;
+    Zygote zygote;
+    HereDocument here_doc;
+    int here_doc_fd;
+    int terminal_fd;
+    LineEditor* line_editor; // built on first use
+    DirectoryState* directory_state; // built on first use
+    RemoteServer* remote_server; // built on first use
+    vector<int> job_event_fds;
+    list<JobOutput*> job_outputs;
+    int capture_saved_fds[2];
     SmallShell();
  public:
   Command *CreateCommand(const char* cmd_line, bool is_special, bool is_piped, bool is_timeout);
+  Command *CreateNamedCommand(const string &name, char* cmd, bool is_piped, bool is_timeout);
+  Command *CreateCompiled(const CompiledCommand &compiled, bool is_piped);
   SmallShell(SmallShell const&)      = delete; // disable copy ctor
   void operator=(SmallShell const&)  = delete; // disable = operator
   static SmallShell& GetInstance() {
@@ -282,15 +1067,68 @@ class SmallShell {
   }
   ~SmallShell();
   void ExecuteCommand(const char* cmd_line, bool is_special = false, bool is_piped = false, bool is_timeout = false);
+  void ExecuteLine(const string &line);
+  bool ExpandWords(const string &line, vector<string> &words, size_t first_glob = 1);
+  void ExpandLexed(const vector<LexedWord> &lexed, vector<string> &words, size_t first_glob = 1);
+  bool SubstituteParameters(const string &line, string &script, vector<string> &outputs);
+  bool ShellWords(const string &shell_line, vector<string> &words);
+  bool ExpandRedirectTarget(string &file_name);
+  bool ExpandRedirectTarget(const vector<LexedWord> &target, string &file_name);
+  void RunCompiled(const CompiledCommand &compiled, bool is_piped = false);
+  size_t CaptureOutput(const string &cmd_line, vector<char> &buffer);
+  bool IsScriptOpen();
 
     string GetPrompt();
     char* GetLastDir();
     JobsList* GetJobsList();
+    JobStateTable* GetJobStateTable();
     JobsList::JobEntry* GetForeGroundJob();
     void UpdateLastDir(char* newDir);
     void AddLastDir(char* lastDir);
     void SetPrompt(string newPrompt);
     void SetForeGroundJob(JobsList::JobEntry* job);
+    void AddPendingPlacement(const JobPlacement &placement);
+    void ClearPendingPlacement();
+    JobPlacement TakePlacement(bool is_background);
+    bool HasPendingCpus();
+    void AddPendingLimits(const JobLimits &limits);
+    void ClearPendingLimits();
+    JobLimits TakeLimits();
+    string GetCgroupRoot();
+    void LeaveCgroup(const string &root);
+    bool AddCoproc(const string &name, CoprocEntry* coproc);
+    CoprocEntry* GetCoproc(const string &name);
+    void ServiceCoprocs();
+    void WaitForInput();
+    long long GetPipeSize();
+    void SetPipeSize(long long size);
+    GlobExpander* GetGlobExpander();
+    void EnableJobControl();
+    bool HasJobControl();
+    void ClaimTerminal();
+    void GiveTerminalTo(pid_t pgid);
+    void WaitForegroundJob(JobsList::JobEntry* job);
+    int GetLastStatus();
+    void SetLastStatus(int status);
+    Environment* GetEnvironment();
+    Zygote* GetZygote();
+    int TakeHereDocFd();
+    LineEditor* GetLineEditor();
+    DirectoryState* GetDirectoryState();
+    RemoteServer* GetRemoteServer();
+    void ServeRemoteOnly();
+    void FollowJobEvents(int fd);
+    void UnfollowJobEvents();
+    bool HasJobEventSubscribers();
+    void PublishJobEvent(const string &event);
+    int BeginOutputCapture();
+    void EndOutputCapture();
+    void AddJobOutput(int read_fd, int job_id, pid_t pid);
+    JobOutput* FindJobOutput(int job_id, pid_t pid = FAIL);
+    void AddJobOutputFds(vector<struct pollfd> &fds) const;
+    void ServiceJobOutputs();
+    CpuPolicy GetCpuPolicy();
+    void SetCpuPolicy(CpuPolicy policy);
     bool IsSmashPid(pid_t pid){
         return (smash_pid == pid);
     };
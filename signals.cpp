@@ -1,96 +1,87 @@
 #include <iostream>
 #include <signal.h>
+#include <errno.h>
 #include "signals.h"
 #include "Commands.h"
 
 using namespace std;
 
+// Only async-signal-safe calls from here on: no cout, no JobsList, no allocation.
+
+static void WriteMessage(const char* msg) {
+    if (msg != nullptr && write(STDOUT_FILENO, msg, strlen(msg)) == FAIL) {
+        return;
+    }
+}
+
+static void WriteProcessMessage(pid_t pid, const char* action) {
+    char digits[16];
+    int len = 0;
+    do {
+        digits[len++] = '0' + (pid % 10);
+        pid /= 10;
+    } while (pid > 0 && len < (int) sizeof(digits));
+    char pid_str[sizeof(digits) + 1];
+    for (int i = 0; i < len; i++) {
+        pid_str[i] = digits[len - 1 - i];
+    }
+    pid_str[len] = '\0';
+    WriteMessage("smash: process ");
+    WriteMessage(pid_str);
+    WriteMessage(" was ");
+    WriteMessage(action);
+    WriteMessage("\n");
+}
+
 void ctrlZHandler(int sig_num) {
-    cout << "smash: got ctrl-Z" << endl;
-    JobsList::JobEntry* fore_ground = SmallShell::GetInstance().GetForeGroundJob();
-    if(fore_ground != nullptr) {
-        pid_t pid = fore_ground->GetJobPid();
+    int saved_errno = errno;
+    WriteMessage("smash: got ctrl-Z\n");
+    pid_t pid = SmallShell::GetInstance().GetJobStateTable()->GetForeground();
+    if(pid != 0) {
         if(killpg(pid, SIGSTOP) != 0) {
-            perror("smash error: kill failed");
-            SmallShell::GetInstance().SetForeGroundJob(nullptr);
-            return;
-        }
-        if(fore_ground->GetJobId() == -1) {
-            SmallShell::GetInstance().GetJobsList()->AddJob(fore_ground, Stopped, true);
+            WriteMessage("smash error: kill failed\n");
         }
         else {
-            SmallShell::GetInstance().GetJobsList()->AddJob(fore_ground, Stopped);
+            WriteProcessMessage(pid, "stopped"); // the waiting main loop moves the job to the jobs list
         }
-        SmallShell::GetInstance().SetForeGroundJob(nullptr);
-        cout << "smash: process " << pid << " was stopped" << endl;
     }
+    errno = saved_errno;
 }
 
 void ctrlCHandler(int sig_num) {
-    cout << "smash: got ctrl-C" << endl;
-    JobsList::JobEntry* fore_ground = SmallShell::GetInstance().GetForeGroundJob();
-    SmallShell::GetInstance().SetForeGroundJob(nullptr);
-    if(fore_ground != NULL) {
-        pid_t pid = fore_ground->GetJobPid();
+    int saved_errno = errno;
+    WriteMessage("smash: got ctrl-C\n");
+    SmallShell::GetInstance().GetJobStateTable()->NoteInterrupt(); // stops a running script
+    pid_t pid = SmallShell::GetInstance().GetJobStateTable()->GetForeground();
+    if(pid != 0) {
         if(killpg(pid, SIGKILL) != 0) {
-            perror("smash error: kill failed");
-            return;
-        }
-        cout << "smash: process " << pid << " was killed" << endl;
-    }
-}
-
-void alarmHandler(int sig_num) {
-    cout << "smash: got an alarm" << endl;
-    JobsList::JobEntry*  job_to_kill = nullptr;
-    SmallShell::GetInstance().GetJobsList()->RemoveFinishedJobs();
-    JobsList::JobEntry* job_from_list_to_kill = SmallShell::GetInstance().GetJobsList()->GetTimeoutJobToKill();
-    JobsList::JobEntry* fore_ground_job = SmallShell::GetInstance().GetForeGroundJob();
-    if (fore_ground_job == nullptr || fore_ground_job->IsTimeOut() == false) {
-        job_to_kill = job_from_list_to_kill;
-    }
-    else {
-        if(job_from_list_to_kill == nullptr) {
-            job_to_kill = fore_ground_job;
+            WriteMessage("smash error: kill failed\n");
         }
         else {
-            bool closer = JobsCmpClosestTime(job_from_list_to_kill, fore_ground_job);
-            if(closer) {
-                job_to_kill = job_from_list_to_kill;
-            }
-            else {
-                job_to_kill = fore_ground_job;
-            }
-        }
-    }
-    if(job_to_kill != nullptr) {
-        cout << "smash: " << job_to_kill->GetCommand()->GetCmdLine() << " timed out!" << endl;
-        if(killpg(job_to_kill->GetJobPid(), SIGKILL) != 0){
-            perror("smash error: kill failed");
-            return;
+            WriteProcessMessage(pid, "killed");
         }
-        SmallShell::GetInstance().GetJobsList()->RemoveJobByPid(job_to_kill->GetJobPid());
     }
+    errno = saved_errno;
+}
 
-    fore_ground_job = SmallShell::GetInstance().GetForeGroundJob();
-    int fore_ground_time = -1 ;
-    if(fore_ground_job != nullptr && fore_ground_job->IsTimeOut()){
-        fore_ground_time = fore_ground_job->GetDifferentTime();
-    }
-    int min_time_job_list = SmallShell::GetInstance().GetJobsList()->GetClosestTimeout();
-    if(min_time_job_list == -1) { // min is not ava but fore is
-        if(fore_ground_time != -1) {
-            alarm(fore_ground_time);
-        }
-    }
-         else { // fore is not ava but min is
-             if(fore_ground_time == -1) {
-                 alarm(min_time_job_list);
-        }
-             else { // both ava, get the min from both
-                alarm(min(fore_ground_time, min_time_job_list));
+void alarmHandler(int sig_num) {
+    int saved_errno = errno;
+    WriteMessage("smash: got an alarm\n");
+    JobStateTable* job_table = SmallShell::GetInstance().GetJobStateTable();
+    pid_t pid;
+    const char* cmd_line;
+    while(job_table->PopExpired(&pid, &cmd_line)) { // reaped and released later by the main loop
+        WriteMessage("smash: ");
+        WriteMessage(cmd_line);
+        WriteMessage(" timed out!\n");
+        if(killpg(pid, SIGKILL) != 0) {
+            WriteMessage("smash error: kill failed\n");
         }
     }
-
+    job_table->ArmAlarm();
+    errno = saved_errno;
 }
 
+void childHandler(int sig_num) {
+    // nothing to do here, the signal only wakes the main loop's poll so job events go out on time
+}
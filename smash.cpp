@@ -5,30 +5,90 @@
 #include "Commands.h"
 #include "signals.h"
 
+static bool InstallHandler(int sig_num, void (*handler)(int)) {
+    struct sigaction action;
+    memset(&action, '\0',sizeof(action));
+    action.sa_handler = handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    return sigaction(sig_num, &action, NULL) == 0;
+}
+
 int main(int argc, char* argv[]) {
-    if(signal(SIGTSTP , ctrlZHandler) == SIG_ERR) {
+    std::ios::sync_with_stdio(false);
+    if(!InstallHandler(SIGTSTP , ctrlZHandler)) {
         perror("smash error: failed to set ctrl-Z handler");
     }
-    if(signal(SIGINT , ctrlCHandler) == SIG_ERR) {
+    if(!InstallHandler(SIGINT , ctrlCHandler)) {
         perror("smash error: failed to set ctrl-C handler");
     }
-
-    struct sigaction action;
-    memset(&action, '\0',sizeof(action));
-    action.sa_handler = alarmHandler;
-    sigemptyset(&action.sa_mask);
-    action.sa_flags = SA_SIGINFO|SA_RESTART;
-    if(sigaction(SIGALRM , &action, NULL) < 0) {
+    if(!InstallHandler(SIGALRM , alarmHandler)) {
         perror("smash error: sigaction failed");
         return 1;
     }
+    if(!InstallHandler(SIGCHLD , childHandler)) {
+        perror("smash error: sigaction failed");
+    }
 
+    bool use_zygote = false;
+    const char* remote_path = nullptr;
+    while(argc >= 2 && (strcmp(argv[1], "-z") == 0 || (strcmp(argv[1], "-s") == 0 && argc >= 3))) {
+        use_zygote = use_zygote || argv[1][1] == 'z';
+        remote_path = (argv[1][1] == 's') ? argv[2] : remote_path;
+        argc -= (argv[1][1] == 's') ? 2 : 1;
+        argv += (argv[1][1] == 's') ? 2 : 1;
+    }
+    if(argc >= 3 && strcmp(argv[1], "-r") == 0) { // remote client, the requests come from argv or stdin
+        std::vector<std::string> requests(argv + 3, argv + argc);
+        for(std::string line; argc == 3 && std::getline(std::cin, line);) {
+            requests.push_back(line);
+        }
+        return RemoteServer::RunClient(argv[2], requests);
+    }
     SmallShell& smash = SmallShell::GetInstance();
+    if(remote_path != nullptr && !smash.GetRemoteServer()->Start(remote_path)) {
+        return 1;
+    }
+    if(argc == 3 && strcmp(argv[1], "-c") == 0) {
+        if(use_zygote) {
+            smash.GetZygote()->Start();
+        }
+        smash.ExecuteLine(argv[2]);
+        if(smash.IsScriptOpen()) {
+            std::cout << "smash error: syntax error: unexpected end of file" << std::endl;
+            return 2;
+        }
+        return smash.GetLastStatus();
+    }
+    smash.EnableJobControl();
+    if(use_zygote) { // after job control, its children claim the terminal the same way
+        smash.GetZygote()->Start();
+    }
     while(true) {
-        std::cout << (smash.GetPrompt()+ " ");
         std::string cmd_line;
-        std::getline(std::cin, cmd_line);
-        smash.ExecuteCommand(cmd_line.c_str(), false, false);
+        bool got_line = false;
+        if(smash.HasJobControl()) { // an interactive terminal gets the line editor
+            got_line = smash.GetLineEditor()->ReadLine(smash.GetPrompt() + " ", cmd_line);
+        }
+        else {
+            std::cout << (smash.GetPrompt()+ " ");
+            smash.WaitForInput();
+            got_line = static_cast<bool>(std::getline(std::cin, cmd_line));
+            if(!got_line && !std::cin.eof()) {
+                std::cin.clear();
+                continue;
+            }
+        }
+        if(!got_line && smash.GetRemoteServer()->IsRunning()) {
+            smash.ServeRemoteOnly();
+        }
+        if(!got_line) {
+            if(smash.IsScriptOpen()) {
+                std::cout << "smash error: syntax error: unexpected end of file" << std::endl;
+            }
+            break;
+        }
+        smash.ExecuteLine(cmd_line);
     }
     return 0;
 }
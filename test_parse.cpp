@@ -0,0 +1,265 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include "Commands.h"
+
+// Invariants of the command-line parsing helpers. The same checks run as a
+// property test on random lines (make test-parse) and as a libFuzzer target
+// built with -DSMASH_FUZZ (make fuzz), seeded from fuzz-seeds/.
+
+static const char LINE_ALPHABET[] = " \t\n&|<>\"'$(){}\\;*?~=-0123456789ab";
+#define SPLIT_WHITESPACE " \n\r\t\f\v"
+
+static void Fail(const char *invariant, const string &line) {
+    cerr << "test_parse: " << invariant << " does not hold for \"" << line << "\"" << endl;
+    abort();
+}
+
+static void CheckBackgroundSign(const string &line) {
+    string once = RemoveBackgroundSign(line);
+    if (RemoveBackgroundSign(once) != once) {
+        Fail("RemoveBackgroundSign is idempotent", line);
+    }
+    if (IsBackgroundCommand(once)) {
+        Fail("RemoveBackgroundSign leaves no background sign", line);
+    }
+    vector<char> buffer(line.c_str(), line.c_str() + line.size() + 1);
+    RemoveBackgroundSign(buffer.data());
+    if (string(buffer.data()) != RemoveBackgroundSign(string(line.c_str()))) {
+        Fail("both RemoveBackgroundSign overloads agree", line);
+    }
+}
+
+static void CheckSkipWords(const string &line) {
+    vector<string> words;
+    int count = ParseCommandLine(line, words);
+    if (count != (int) words.size()) {
+        Fail("ParseCommandLine returns the number of words", line);
+    }
+    for (int skip = 0; skip <= count + 1; skip++) {
+        size_t pos = SkipWords(line, skip);
+        if (skip > count) {
+            if (pos != FIND_FAIL) {
+                Fail("SkipWords past the last word is npos", line);
+            }
+            continue;
+        }
+        vector<string> rest;
+        if (pos == FIND_FAIL || pos > line.size() || ParseCommandLine(line.substr(pos), rest) != count - skip ||
+            !equal(rest.begin(), rest.end(), words.begin() + skip)) {
+            Fail("SkipWords agrees with ParseCommandLine", line);
+        }
+    }
+    string first = GetFirstStringInCmdLine(line.c_str());
+    vector<string> c_words;
+    ParseCommandLine(RemoveBackgroundSign(string(line.c_str())), c_words);
+    if (first != (c_words.empty() ? "" : c_words[0])) {
+        Fail("GetFirstStringInCmdLine is the first word", line);
+    }
+}
+
+static void CheckTimeoutSign(const string &line) {
+    vector<char> buffer(line.c_str(), line.c_str() + line.size() + 1);
+    size_t length = strlen(buffer.data());
+    RemoveTimeoutSign(buffer.data());
+    if (strlen(buffer.data()) > length) {
+        Fail("RemoveTimeoutSign only shortens the line", line);
+    }
+    IsTimeoutCommand(line.c_str());
+}
+
+static void CheckFindUnquoted(const string &line) {
+    size_t pos = FindUnquoted(line, "|<>&");
+    if (pos != FIND_FAIL && (pos >= line.size() || strchr("|<>&", line[pos]) == nullptr)) {
+        Fail("FindUnquoted returns a position of one of the characters", line);
+    }
+    IsStringNumber(line);
+}
+
+static bool HasWords(const string &text) {
+    vector<string> words;
+    return ParseCommandLine(text, words) > 0;
+}
+
+static string Trim(const string &text) {
+    size_t start = text.find_first_not_of(SPLIT_WHITESPACE);
+    return (start == FIND_FAIL) ? "" : text.substr(start, text.find_last_not_of(SPLIT_WHITESPACE) - start + 1);
+}
+
+// text at pos is blanks, then target, then a tail that starts where an unquoted word would end
+static bool IsTargetAt(const string &text, size_t pos, const string &target) {
+    size_t start = text.find_first_not_of(SPLIT_WHITESPACE, pos);
+    if (start == FIND_FAIL) {
+        return target.empty();
+    }
+    if (text.compare(start, target.size(), target) != 0) {
+        return false;
+    }
+    size_t tail = start + target.size();
+    return tail == text.size() || strchr(SPLIT_WHITESPACE "<>&|", text[tail]) != nullptr;
+}
+
+// the commands own their line and free it with delete[]
+static char* CopyLine(const string &text) {
+    char* copy = new char[text.size() + 1];
+    memcpy(copy, text.c_str(), text.size() + 1);
+    return copy;
+}
+
+static void CheckRedirection(const string &text) {
+    RedirectionCommand cmd(CopyLine(text));
+    size_t pos = FindUnquoted(text, ">");
+    string before = text.substr(0, pos);
+    if (cmd.GetSign() != ((text.compare(pos, 2, ">>") == 0) ? ">>" : ">")) {
+        Fail("RedirectionCommand reads > or >>", text);
+    }
+    if (cmd.GetNewCmdLine() != (HasWords(before) ? before : "")) {
+        Fail("RedirectionCommand keeps the command before the sign", text);
+    }
+    if (!IsTargetAt(text, pos + cmd.GetSign().size(), cmd.GetFileName())) {
+        Fail("RedirectionCommand takes the target right after the sign", text);
+    }
+}
+
+static void CheckInputRedirection(const string &text) {
+    InputRedirectionCommand cmd(CopyLine(text));
+    size_t pos = FindUnquoted(text, "<");
+    size_t after = pos + (cmd.IsHereDoc() ? 2 : 1);
+    if (cmd.IsHereDoc() != (text.compare(pos, 2, "<<") == 0)) {
+        Fail("InputRedirectionCommand reads < or <<", text);
+    }
+    if (!IsTargetAt(text, after, cmd.GetFileName())) {
+        Fail("InputRedirectionCommand takes the target right after the sign", text);
+    }
+    size_t target = text.find_first_not_of(SPLIT_WHITESPACE, after);
+    string rest = (target == FIND_FAIL) ? "" : Trim(text.substr(target + cmd.GetFileName().size()));
+    if (cmd.GetNewCmdLine() != Trim(text.substr(0, pos)) + (rest.empty() ? "" : " " + rest)) {
+        Fail("InputRedirectionCommand joins the words around the redirection", text);
+    }
+}
+
+static void CheckPipe(const string &text) {
+    PipeCommand cmd(CopyLine(text));
+    size_t pos = FindUnquoted(text, "|");
+    string before = text.substr(0, pos);
+    if (cmd.GetSign() != ((text.compare(pos, 2, "|&") == 0) ? "|&" : "|")) {
+        Fail("PipeCommand reads | or |&", text);
+    }
+    if (cmd.IsBackground() != IsBackgroundCommand(text.c_str())) {
+        Fail("PipeCommand runs in the background only for a trailing &", text);
+    }
+    // first may only have lost a leading "pipesize N"
+    const string &first = cmd.GetFirst();
+    if (HasWords(before) ? (first.size() > before.size() ||
+                            before.compare(before.size() - first.size(), first.size(), first) != 0)
+                         : !first.empty()) {
+        Fail("PipeCommand keeps the command before the sign", text);
+    }
+    string after = text.substr(pos + cmd.GetSign().size());
+    string second = cmd.IsBackground() ? RemoveBackgroundSign(after) : after;
+    if (cmd.GetSecond() != (HasWords(after) ? second : "")) {
+        Fail("PipeCommand keeps the command after the sign", text);
+    }
+}
+
+static void CheckSplitCommands(const string &line) {
+    string text = line.c_str(); // the commands get a C string, like CreateCommand gives them
+    try {
+        if (IsRedirectionCommand(text.c_str())) {
+            CheckRedirection(text);
+        }
+        if (IsInputRedirectionCommand(text.c_str())) {
+            CheckInputRedirection(text);
+        }
+        if (IsPipeCommand(text.c_str())) {
+            CheckPipe(text);
+        }
+    }
+    catch (const exception &error) {
+        Fail("splitting a redirection or pipe throws no exception", text);
+    }
+}
+
+static void CheckLexWords(const string &line) {
+    vector<LexedWord> words;
+    string error;
+    if (!LexWords(line, words, &error)) {
+        if (error.empty()) {
+            Fail("LexWords explains why it fails", line);
+        }
+        return;
+    }
+    for (size_t i = 0; i < words.size(); i++) {
+        if (words[i].empty()) {
+            Fail("LexWords keeps no empty word", line);
+        }
+        for (size_t j = 1; j < words[i].size(); j++) {
+            if (words[i][j].kind == WordPart::Literal && words[i][j - 1].kind == WordPart::Literal &&
+                words[i][j].quoted == words[i][j - 1].quoted) {
+                Fail("LexWords merges neighbouring literal text", line);
+            }
+        }
+    }
+    if (line.find_first_of("\"'\\$~") != FIND_FAIL) {
+        return;
+    }
+    vector<string> plain; // without quotes or expansions it splits like ParseCommandLine
+    ParseCommandLine(line, plain);
+    bool same = (plain.size() == words.size());
+    for (size_t i = 0; same && i < words.size(); i++) {
+        same = words[i].size() == 1 && words[i][0].kind == WordPart::Literal && words[i][0].text == plain[i];
+    }
+    if (!same) {
+        Fail("LexWords splits plain words like ParseCommandLine", line);
+    }
+}
+
+static void CheckLine(const string &line) {
+    CheckBackgroundSign(line);
+    CheckSkipWords(line);
+    CheckTimeoutSign(line);
+    CheckFindUnquoted(line);
+    CheckSplitCommands(line);
+    CheckLexWords(line);
+}
+
+#ifdef SMASH_FUZZ
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    CheckLine(string((const char *) data, size));
+    return 0;
+}
+
+#ifdef SMASH_FUZZ_REPLAY
+// runs corpus files through the fuzz target without libFuzzer, for compilers that don't ship it (make fuzz-replay)
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        ifstream file(argv[i], ios::binary);
+        string input((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+        LLVMFuzzerTestOneInput((const uint8_t *) input.data(), input.size());
+    }
+    cout << "test_parse: " << argc - 1 << " corpus files passed" << endl;
+    return 0;
+}
+#endif
+#else
+int main(int argc, char *argv[]) {
+    unsigned long lines = (argc > 1) ? strtoul(argv[1], nullptr, 10) : 100000;
+    unsigned long seed = (argc > 2) ? strtoul(argv[2], nullptr, 10) : random_device()();
+    mt19937 generator(seed);
+    uniform_int_distribution<size_t> length(0, COMMAND_ARGS_MAX_LENGTH);
+    uniform_int_distribution<size_t> letter(0, sizeof(LINE_ALPHABET) - 2);
+    uniform_int_distribution<int> byte(0, 255);
+    for (unsigned long i = 0; i < lines; i++) {
+        string line;
+        size_t size = length(generator);
+        for (size_t j = 0; j < size; j++) { // mostly shell syntax, sometimes any byte including NUL
+            line.push_back((j % 16 == 15) ? (char) byte(generator) : LINE_ALPHABET[letter(generator)]);
+        }
+        CheckLine(line);
+    }
+    cout << "test_parse: " << lines << " lines passed, seed " << seed << endl;
+    return 0;
+}
+#endif